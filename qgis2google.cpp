@@ -40,14 +40,17 @@
 #include <QAction>
 #include <QDockWidget>
 #include <QLabel>
+#include <QMainWindow>
 #include <QMenu>
 #include <QMessageBox>
 #include <QStandardItem>
+#include <QStatusBar>
 #include <QToolBar>
 #include <QToolButton>
 #include <QVBoxLayout>
 
 #include "qgsgoogleearthtool.h"
+#include "qgskmlfolderwatcher.h"
 #include "qgskmlsettingsdialog.h"
 
 
@@ -108,6 +111,33 @@ void qgis2google::initGui()
   mQGisIface->addPluginToMenu( mPluginName, mLayerToEarthAction );
   mToolsToolBar->addAction( mLayerToEarthAction );
 
+  mLayersToEarthAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Send all visible layers to Google Earth" ), this );
+  connect( mLayersToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayersToKml() ) );
+  mQGisIface->addPluginToMenu( mPluginName, mLayersToEarthAction );
+
+  mLayerTilesToEarthAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Send layer to Google Earth as raster tiles" ), this );
+  connect( mLayerTilesToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerToSuperOverlay() ) );
+  mQGisIface->addPluginToMenu( mPluginName, mLayerTilesToEarthAction );
+
+  mLayerPartitionsToEarthAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Send layer to Google Earth by categories" ), this );
+  connect( mLayerPartitionsToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerPartitions() ) );
+  mQGisIface->addPluginToMenu( mPluginName, mLayerPartitionsToEarthAction );
+
+  mLayerPreviewToEarthAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Send layer preview to Google Earth" ), this );
+  connect( mLayerPreviewToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerPreview() ) );
+  mQGisIface->addPluginToMenu( mPluginName, mLayerPreviewToEarthAction );
+
+  mLayerEditsToEarthAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Follow layer edits in Google Earth" ), this );
+  connect( mLayerEditsToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( followLayerEdits() ) );
+  mQGisIface->addPluginToMenu( mPluginName, mLayerEditsToEarthAction );
+
+  mFolderWatcher = new QgsKmlFolderWatcher( this );
+  connect( mFolderWatcher, SIGNAL( statusChanged( const QString & ) ), SLOT( showWatchStatus( const QString & ) ) );
+  mWatchFoldersAction = new QAction( QIcon( ":/plugins/qgis2google/icons/layer_to_google_earth.png"), tr( "Publish changed datasets of watched folders" ), this );
+  mWatchFoldersAction->setCheckable( true );
+  connect( mWatchFoldersAction, SIGNAL( toggled( bool ) ), SLOT( watchFolders( bool ) ) );
+  mQGisIface->addPluginToMenu( mPluginName, mWatchFoldersAction );
+
   mSettingsAction = new QAction( QIcon( ":/plugins/qgis2google/icons/settings.png" ), tr( "Settings" ), this );
   connect( mSettingsAction, SIGNAL( triggered() ), SLOT( settings() ) );
   mQGisIface->addPluginToMenu( mPluginName, mSettingsAction );
@@ -133,12 +163,24 @@ void qgis2google::unload()
 {
   disconnect( mFeatureToEarthAction, SIGNAL( triggered() ), this, SLOT( setToolToEarth() ) );
   disconnect( mLayerToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerToKml() ) );
+  disconnect( mLayersToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayersToKml() ) );
+  disconnect( mLayerTilesToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerToSuperOverlay() ) );
+  disconnect( mLayerPartitionsToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerPartitions() ) );
+  disconnect( mLayerPreviewToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( exportLayerPreview() ) );
+  disconnect( mLayerEditsToEarthAction, SIGNAL( triggered() ), mSendToEarthTool, SLOT( followLayerEdits() ) );
+  disconnect( mWatchFoldersAction, SIGNAL( toggled( bool ) ), this, SLOT( watchFolders( bool ) ) );
   disconnect( mSettingsAction, SIGNAL( triggered() ), this, SLOT( settings() ) );
   disconnect( mQGisIface, SIGNAL(currentLayerChanged(QgsMapLayer*)), this, SLOT(setDefaultSettings(QgsMapLayer*)) );
   disconnect( mInfoAction, SIGNAL( triggered() ), this, SLOT( about() ) );
 
   mQGisIface->removePluginMenu( mPluginName, mFeatureToEarthAction );
   mQGisIface->removePluginMenu( mPluginName, mLayerToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mLayersToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mLayerTilesToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mLayerPartitionsToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mLayerPreviewToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mLayerEditsToEarthAction );
+  mQGisIface->removePluginMenu( mPluginName, mWatchFoldersAction );
   mQGisIface->removePluginMenu( mPluginName, mSettingsAction );
   mQGisIface->removePluginMenu( mPluginName, mInfoAction );
   mToolsToolBar->removeAction( mFeatureToEarthAction );
@@ -146,9 +188,16 @@ void qgis2google::unload()
   mToolsToolBar->removeAction( mSettingsAction );
 
   delete mSendToEarthTool;
+  delete mFolderWatcher;
   delete mToolsToolBar;
 
   delete mLayerToEarthAction;
+  delete mLayersToEarthAction;
+  delete mLayerTilesToEarthAction;
+  delete mLayerPartitionsToEarthAction;
+  delete mLayerPreviewToEarthAction;
+  delete mLayerEditsToEarthAction;
+  delete mWatchFoldersAction;
   delete mSettingsAction;
   delete mInfoAction;
 }
@@ -158,13 +207,43 @@ void qgis2google::setToolToEarth()
   mQGisIface->mapCanvas()->setMapTool( mSendToEarthTool );
 }
 
+void qgis2google::watchFolders( bool watch )
+{
+  if ( !watch )
+  {
+    mFolderWatcher->stop();
+    showWatchStatus( tr( "Folders are not watched" ) );
+    return;
+  }
+
+  if ( !mFolderWatcher->start() )
+  {
+    QMessageBox::information( mQGisIface->mainWindow(), tr( "Watch folders" ),
+                              tr( "Set existing folders to watch and the folder to publish to in the settings." ) );
+    mWatchFoldersAction->setChecked( false );
+  }
+}
+
+void qgis2google::showWatchStatus( const QString &status )
+{
+  mWatchFoldersAction->setToolTip( status );
+  QMainWindow *mainWindow = dynamic_cast<QMainWindow *>( mQGisIface->mainWindow() );
+  if ( mainWindow )
+    mainWindow->statusBar()->showMessage( status, 5000 );
+}
+
 void qgis2google::settings()
 {
   QgsVectorLayer *vlayer = dynamic_cast< QgsVectorLayer *>( mQGisIface->activeLayer() );
   if ( !vlayer )
     return;
 
-  QgsKmlSettingsDialog settingsDialog( 0, vlayer->geometryType() );
+  QStringList fieldNames;
+  const QgsFieldMap &fields = vlayer->pendingFields();
+  for ( QgsFieldMap::const_iterator it = fields.constBegin(); it != fields.constEnd(); ++it )
+    fieldNames << it->name();
+
+  QgsKmlSettingsDialog settingsDialog( 0, vlayer->geometryType(), fieldNames, vlayer->getLayerID() );
   settingsDialog.exec();
 }
 
@@ -48,6 +48,7 @@ class QToolBar;
 
 class QgisInterface;
 class QgsGoogleEarthTool;
+class QgsKmlFolderWatcher;
 class QgsMapLayer;
 class QgsMapTool;
 
@@ -82,6 +83,9 @@ private slots:
   //! tune plugin
   void settings();
   void setDefaultSettings( QgsMapLayer *layer );
+  //! publish datasets of the watched folders while checked
+  void watchFolders( bool watch );
+  void showWatchStatus( const QString &status );
   void about();
 
 private:
@@ -90,9 +94,16 @@ private:
   QgisInterface *mQGisIface;
 
   QgsGoogleEarthTool *mSendToEarthTool;
+  QgsKmlFolderWatcher *mFolderWatcher;
 
   QAction *mFeatureToEarthAction;
   QAction *mLayerToEarthAction;
+  QAction *mLayersToEarthAction;
+  QAction *mLayerTilesToEarthAction;
+  QAction *mLayerPartitionsToEarthAction;
+  QAction *mLayerPreviewToEarthAction;
+  QAction *mLayerEditsToEarthAction;
+  QAction *mWatchFoldersAction;
   QAction *mSettingsAction;
   QAction *mInfoAction;
 
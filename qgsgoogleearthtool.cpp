@@ -1,8 +1,12 @@
+#include <QApplication>
 #include <QDesktopServices>
 #include <QDir>
+#include <QMainWindow>
 #include <QMessageBox>
 #include <QMouseEvent>
 #include <QRubberBand>
+#include <QSettings>
+#include <QStatusBar>
 #include <QUrl>
 
 #include <qgisinterface.h>
@@ -13,22 +17,43 @@
 #include <qgsvectorlayer.h>
 
 #include "qgsgoogleearthtool.h"
-#include "qgskmlconverter.h"
+#include "qgskmlexportscheduler.h"
+#include "qgskmllivelink.h"
 
 QgsGoogleEarthTool::QgsGoogleEarthTool( QgsMapCanvas *canvas )
     : QgsMapTool( canvas ), mDragging( false ), mRubberBand( NULL ),
-    kmlConverter( new QgsKmlConverter )
+    mScheduler( new QgsKmlExportScheduler( canvas, this ) ), mLiveLink( NULL )
 {
   mCursor = QCursor( Qt::PointingHandCursor );
+  connect( mScheduler, SIGNAL( exportFinished( const QString &, const QString & ) ),
+           SLOT( openInGoogleEarth( const QString &, const QString & ) ) );
 }
 
 QgsGoogleEarthTool::~QgsGoogleEarthTool()
 {
-  delete kmlConverter;
+}
+
+void QgsGoogleEarthTool::activate()
+{
+  QgsMapTool::activate();
+  connect( mCanvas, SIGNAL( extentsChanged() ), SLOT( preEncodeCanvasFeatures() ) );
+  preEncodeCanvasFeatures();
+}
+
+void QgsGoogleEarthTool::deactivate()
+{
+  disconnect( mCanvas, SIGNAL( extentsChanged() ), this, SLOT( preEncodeCanvasFeatures() ) );
+  mPreEncodedLayerId.clear();
+  QgsMapTool::deactivate();
 }
 
 void QgsGoogleEarthTool::canvasMoveEvent( QMouseEvent *e )
 {
+  // current layer changed since the view was encoded
+  QgsMapLayer *layer = mCanvas->currentLayer();
+  if ( layer && layer->getLayerID() != mPreEncodedLayerId )
+    preEncodeCanvasFeatures();
+
   if ( !( e->buttons() & Qt::LeftButton ) )
     return;
 
@@ -60,7 +85,6 @@ void QgsGoogleEarthTool::canvasReleaseEvent( QMouseEvent *e )
   QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
   if ( vlayer )
   {
-    QgsFeatureList featureList;
     if ( mDragging )
     {
       mDragging = false;
@@ -71,21 +95,14 @@ void QgsGoogleEarthTool::canvasReleaseEvent( QMouseEvent *e )
       mGERect.setRight( e->pos().x() );
       mGERect.setBottom( e->pos().y() );
 
-      // get features list selected by rectangle
-      featureList = selecteManyFeatures( vlayer, mGERect );
+      // send features selected by rectangle
+      sendManyFeatures( vlayer, mGERect );
     }
     else
     {
-      // get selected feature
-      featureList = selectOneFeature( vlayer, e->pos() );
+      // send feature under the cursor
+      sendOneFeature( vlayer, e->pos() );
     }
-
-    // export selected features to kml
-    QString tempFileName = kmlConverter->exportFeaturesToKmlFile( vlayer, featureList );
-
-    // open kml in Google Earth
-    if ( !tempFileName.isEmpty() && QFileInfo( tempFileName ).exists() )
-      QDesktopServices::openUrl( QUrl::fromLocalFile( tempFileName ) );
   }
   else
   {
@@ -103,14 +120,178 @@ void QgsGoogleEarthTool::exportLayerToKml()
   QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
   if ( vlayer )
   {
+    QSettings settings;
+    QString filter = settings.value( "/qgis2google/filter/layers/" + vlayer->getLayerID() ).toString();
+    QgsRectangle rect;
+    if ( settings.value( "/qgis2google/filter/canvasextent" ).toBool() )
+    {
+      try
+      {
+        rect = toLayerCoordinates( vlayer, mCanvas->extent() );
+      }
+      catch ( QgsCsException &cse )
+      {
+        Q_UNUSED( cse );
+        // export whole layer
+        QgsLogger::warning( "Caught CRS exception " + QString( __FILE__ ) + ": " + QString::number( __LINE__ ) );
+      }
+    }
+
+    // whole layer may be too big for plain kml, offer a better way
+    QgsKmlConverter::ExportStrategy strategy = QgsKmlConverter::PlainKml;
+    qint64 expectedBytes = 0;
+    if ( filter.isEmpty() && rect.isEmpty() )
+    {
+      QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+      QgsKmlConverter::ExportEstimate estimate = mScheduler->estimateLayer( vlayer );
+      QgsApplication::restoreOverrideCursor();
+      expectedBytes = estimate.bytes;
+
+      if ( estimate.strategy != QgsKmlConverter::PlainKml )
+      {
+        QMessageBox::StandardButton answer = QMessageBox::question(
+              mCanvas->window(), tr( "Send layer to Google Earth" ),
+              tr( "About %1 features, %2 vertices and %3 MB of kml are expected, sending takes about %4 s.\n"
+                  "Do you want to %5 instead of sending plain kml?" )
+              .arg( estimate.featureCount ).arg( estimate.vertices )
+              .arg( estimate.bytes / 1048576.0, 0, 'f', 1 ).arg( estimate.msecs / 1000.0, 0, 'f', 1 )
+              .arg( QgsKmlConverter::strategyDescription( estimate.strategy ) ),
+              QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel );
+
+        if ( answer == QMessageBox::Cancel )
+          return;
+        if ( answer == QMessageBox::Yes )
+        {
+          if ( estimate.strategy == QgsKmlConverter::RasterTiles )
+          {
+            mScheduler->sendLayerTiles( vlayer );
+            return;
+          }
+          // settings stay as they are, the strategy is for this export only
+          strategy = estimate.strategy;
+        }
+      }
+    }
+
     // export active layer to kml
-    QString tempFileName = kmlConverter->exportLayerToKmlFile( vlayer );
-    // open kml in Google Earth
-    QDesktopServices::openUrl( QUrl( "file:///" + tempFileName ) );
+    mScheduler->sendLayer( vlayer, filter, rect, strategy, expectedBytes );
+  }
+}
+
+void QgsGoogleEarthTool::exportLayersToKml()
+{
+  QList<QgsVectorLayer *> layers;
+  foreach ( QgsMapLayer *layer, mCanvas->layers() )
+  {
+    QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( layer );
+    if ( vlayer )
+      layers << vlayer;
   }
+
+  // export all visible vector layers to one kml
+  if ( !layers.isEmpty() )
+    mScheduler->sendLayers( layers );
 }
 
-QgsFeatureList QgsGoogleEarthTool::selectOneFeature( QgsVectorLayer *vlayer, const QPoint &pos )
+void QgsGoogleEarthTool::exportLayerToSuperOverlay()
+{
+  QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
+  if ( vlayer )
+  {
+    // render active layer to tiles
+    mScheduler->sendLayerTiles( vlayer );
+  }
+}
+
+void QgsGoogleEarthTool::exportLayerPartitions()
+{
+  QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
+  if ( vlayer )
+  {
+    // each class of active layer to its own kml
+    mScheduler->sendLayerPartitions( vlayer );
+  }
+}
+
+void QgsGoogleEarthTool::exportLayerPreview()
+{
+  QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
+  if ( vlayer )
+  {
+    // quick look at sample of active layer
+    mScheduler->sendLayerPreview( vlayer );
+  }
+}
+
+void QgsGoogleEarthTool::followLayerEdits()
+{
+  QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( mCanvas->currentLayer() );
+  if ( !vlayer )
+    return;
+
+  if ( !vlayer->isEditable() )
+  {
+    QMessageBox::information( mCanvas->window(), tr( "Follow layer edits" ),
+                              tr( "Start editing the layer to follow its edits in Google Earth." ) );
+    return;
+  }
+
+  if ( !QgsKmlLiveLink::isSupported() )
+  {
+    QMessageBox::information( mCanvas->window(), tr( "Follow layer edits" ),
+                              tr( "Merged or clustered placemarks can not follow edits, "
+                                  "turn merging and clustering off in the settings." ) );
+    return;
+  }
+
+  delete mLiveLink;
+  mLiveLink = new QgsKmlLiveLink( vlayer, this );
+  QString fileName = mLiveLink->start();
+  if ( !fileName.isEmpty() )
+    openInGoogleEarth( fileName, QString() );
+}
+
+void QgsGoogleEarthTool::openInGoogleEarth( const QString &fileName, const QString &statistics )
+{
+  if ( !statistics.isEmpty() )
+  {
+    QMainWindow *mainWindow = qobject_cast<QMainWindow *>( mCanvas->window() );
+    if ( mainWindow )
+      mainWindow->statusBar()->showMessage( statistics );
+  }
+
+  // open kml in Google Earth
+  if ( QFileInfo( fileName ).exists() )
+    QDesktopServices::openUrl( QUrl::fromLocalFile( fileName ) );
+}
+
+void QgsGoogleEarthTool::preEncodeCanvasFeatures()
+{
+  QgsMapLayer *layer = mCanvas->currentLayer();
+  mPreEncodedLayerId = layer ? layer->getLayerID() : QString();
+
+  QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer*>( layer );
+  QSettings settings;
+  if ( !vlayer || !settings.value( "/qgis2google/preencode/enabled" ).toBool() )
+    return;
+
+  QgsRectangle extent = mCanvas->extent();
+  QgsRectangle layerRect;
+  try
+  {
+    layerRect = toLayerCoordinates( vlayer, extent );
+  }
+  catch ( QgsCsException &cse )
+  {
+    Q_UNUSED( cse );
+    // view extends beyond layer's coordinate system, clicks are encoded when sent
+    return;
+  }
+
+  mScheduler->preEncodeFeatures( vlayer, layerRect, simplifyTolerance( layerRect, extent ) );
+}
+
+void QgsGoogleEarthTool::sendOneFeature( QgsVectorLayer *vlayer, const QPoint &pos )
 {
     // copy|past from QgsMapToolSelect
     QRect select_rect;
@@ -138,11 +319,10 @@ QgsFeatureList QgsGoogleEarthTool::selectOneFeature( QgsVectorLayer *vlayer, con
     QgsPoint ur = transform->toMapCoordinates( select_rect.right(), select_rect.top() );
     QgsRectangle searchRect( ll.x(), ll.y(), ur.x(), ur.y() );
 
-    selecteFeatures( vlayer, searchRect );
-    return vlayer->selectedFeatures();
+    sendFeatures( vlayer, searchRect );
 }
 
-QgsFeatureList QgsGoogleEarthTool::selecteManyFeatures( QgsVectorLayer *vlayer, const QRect &rect )
+void QgsGoogleEarthTool::sendManyFeatures( QgsVectorLayer *vlayer, const QRect &rect )
 {
   const QgsMapToPixel* coordinateTransform = mCanvas->getCoordinateTransform();
 
@@ -157,11 +337,12 @@ QgsFeatureList QgsGoogleEarthTool::selecteManyFeatures( QgsVectorLayer *vlayer,
   searchRect.setYMaximum( ur.y() );
   searchRect.normalize();
 
-  selecteFeatures( vlayer, searchRect );
-  return vlayer->selectedFeatures();
+  sendFeatures( vlayer, searchRect );
 }
 
-void QgsGoogleEarthTool::selecteFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect )
+// send features intersecting the rectangle, they are queried read-only so
+// layer selection stays untouched
+void QgsGoogleEarthTool::sendFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect )
 {
   // prevent selecting to an empty extent
   if ( rect.width() == 0 || rect.height() == 0 )
@@ -177,14 +358,24 @@ void QgsGoogleEarthTool::selecteFeatures( QgsVectorLayer *vlayer, const QgsRecta
   catch ( QgsCsException &cse )
   {
     Q_UNUSED( cse );
-    // catch exception for 'invalid' rectangle and leave existing selection unchanged
+    // catch exception for 'invalid' rectangle and send nothing
     QgsLogger::warning( "Caught CRS exception " + QString( __FILE__ ) + ": " + QString::number( __LINE__ ) );
     QMessageBox::warning( mCanvas, QObject::tr( "CRS Exception" ),
                           QObject::tr( "Selection extends beyond layer's coordinate system." ) );
     return;
   }
 
-  QgsApplication::setOverrideCursor( Qt::WaitCursor );
-  vlayer->select( searchRect, false );
-  QgsApplication::restoreOverrideCursor();
+  // queued, exact intersection test is done by the provider
+  mScheduler->sendFeatures( vlayer, searchRect, simplifyTolerance( searchRect, rect ) );
+}
+
+// detail finer than a canvas pixel is not seen anyway, shift sends full detail
+double QgsGoogleEarthTool::simplifyTolerance( const QgsRectangle &layerRect, const QgsRectangle &mapRect ) const
+{
+  QSettings settings;
+  if ( !settings.value( "/qgis2google/simplify/enabled" ).toBool()
+       || ( QApplication::keyboardModifiers() & Qt::ShiftModifier ) )
+    return 0.0;
+
+  return mCanvas->mapUnitsPerPixel() * layerRect.width() / mapRect.width();
 }
@@ -10,7 +10,8 @@ class QRubberBand;
 
 class QgsVectorLayer;
 
-class QgsKmlConverter;
+class QgsKmlExportScheduler;
+class QgsKmlLiveLink;
 
 class QgsGoogleEarthTool : public QgsMapTool
 {
@@ -19,8 +20,21 @@ public:
   QgsGoogleEarthTool( QgsMapCanvas *canvas );
   ~QgsGoogleEarthTool( );
 
+  void activate();
+  void deactivate();
+
 public slots:
   void exportLayerToKml();
+  void exportLayersToKml();
+  void exportLayerToSuperOverlay();
+  void exportLayerPartitions();
+  void exportLayerPreview();
+  void followLayerEdits();
+
+private slots:
+  void openInGoogleEarth( const QString &fileName, const QString &statistics );
+  //! features in view are encoded while the user aims
+  void preEncodeCanvasFeatures();
 
 protected:
   void canvasPressEvent( QMouseEvent *e );
@@ -28,9 +42,11 @@ protected:
   void canvasReleaseEvent( QMouseEvent *e );
 
 private:
-  void selecteFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect );
-  QgsFeatureList selecteManyFeatures( QgsVectorLayer *vlayer, const QRect &rect );
-  QgsFeatureList selectOneFeature( QgsVectorLayer *vlayer, const QPoint &pos );
+  void sendFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect );
+  void sendManyFeatures( QgsVectorLayer *vlayer, const QRect &rect );
+  void sendOneFeature( QgsVectorLayer *vlayer, const QPoint &pos );
+  //! canvas pixel in layer units, 0 when features are not simplified
+  double simplifyTolerance( const QgsRectangle &layerRect, const QgsRectangle &mapRect ) const;
 
   QList<QFile *> mTempKmlFiles;
   //! stores Google Earth select rect
@@ -42,5 +58,9 @@ private:
   //! TODO: to be changed to a canvas item
   QRubberBand *mRubberBand;
 
-  QgsKmlConverter *kmlConverter;
+  QgsKmlExportScheduler *mScheduler;
+  //! link of the layer being edited, files of the previous one are removed
+  QgsKmlLiveLink *mLiveLink;
+  //! layer whose features in view were pre-encoded last
+  QString mPreEncodedLayerId;
 };
@@ -1,22 +1,95 @@
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QFuture>
+#include <QImage>
 #include <QMessageBox>
+#include <QPainter>
+#include <QPointer>
+#include <QRegExp>
+#include <QSet>
+#include <QSharedPointer>
+#include <QTextCodec>
+#include <QThread>
+#include <QTime>
+#include <QTextDocument>
+#include <QUrl>
+#include <QVector>
+#include <QtConcurrentRun>
 
 #include <qgsapplication.h>
 #include <qgsgeometry.h>
 #include <qgslogger.h>
 #include <qgsmapcanvas.h>
+#include <qgsmaprenderer.h>
 #include <qgsrenderer.h>
+#include <qgscategorizedsymbolrendererv2.h>
+#include <qgsgraduatedsymbolrendererv2.h>
+#include <qgsrulebasedrendererv2.h>
+#include <qgssinglesymbolrendererv2.h>
+#include <qgssymbolv2.h>
+#include <qgssearchstring.h>
+#include <qgssearchtreenode.h>
 #include <qgssymbol.h>
+#include <qgsvectordataprovider.h>
 #include <qgsvectorlayer.h>
 #include <qgsuniquevaluerenderer.h>
 
 #include "qgskmlconverter.h"
+#include "qgskmldatabasereader.h"
+#include "qgskmlexportcheckpoint.h"
+#include "qgskmlfilewriter.h"
+#include "qgskmlshapefilereader.h"
+#include "qgskmzwriter.h"
 
 #define STYLEIDDELIMIT "."
+// id of kml document, target of placemarks created by updates
+#define DOCUMENTID "layers"
+
+// size of rendered point icons (px)
+#define ICONSIZE 32
+
+// preview is sent even if not all cells are read in this time (ms)
+#define PREVIEWTIMELIMIT 700
+
+// features read to estimate the export and limits of plain kml
+#define ESTIMATESAMPLESIZE 300
+#define ESTIMATEMAXPLACEMARKS 50000
+#define ESTIMATEMAXBYTES 100000000
+
+// vertices read to find precision of the data and the finest quantization,
+// grid coordinates of finer precision would overflow
+#define QUANTIZESAMPLESIZE 1000
+#define MAXDECIMALS 6
+// grid steps between vertices whose products fit in qint64
+#define QUANTIZEMAXSTEP 2147483647LL
+
+// times the simplify tolerance is doubled at most to get under the vertex limit
+#define SIMPLIFYMAXSTEPS 32
+
+// features encoded together and written between checkpoints of resumable exports
+#define CHECKPOINTFEATURES 10000
+
+// features encoded ahead between events and memory for their placemarks (bytes)
+#define PREENCODEBATCHSIZE 200
+#define PLACEMARKCACHESIZE 33554432
+
+// characters of a folder converted to utf-8 and passed to the writer at once
+#define FOLDERWRITECHUNK 262144
+
+QHash<QString, int> QgsKmlConverter::sStyleFileUsers;
 
 const QString myPathToIcon = "http://maps.google.com/mapfiles/kml/shapes/donut.png";
 
 QgsKmlConverter::QgsKmlConverter()
+    : mScannedFeatures( 0 ), mExportedFeatures( 0 ), mPlacemarks( 0 ), mExportTime( 0 ),
+    mWriterStallTime( 0 ), mWriterIdleTime( 0 ), mFilterPushedDown( false ), mCompact( false ), mEmbedIcons( false ), mInlineStyles( false ),
+    mStrategy( PlainKml ),
+    mPlacemarkCacheBytes( 0 ), mPlacemarkCacheTolerance( 0.0 ), mPlacemarkCacheEdits( 0 ), mUsePlacemarkCache( false ),
+    mExpectedBytes( 0 ), mYieldInterval( 0 ), mCanceled( false ), mLayerInterrupted( false ), mReadingLayer( NULL )
 {
   QgsApplication::setOrganizationName( "gis-lab" );
   QgsApplication::setOrganizationDomain( "gis-lab.info" );
@@ -31,127 +104,2321 @@ QgsKmlConverter::~QgsKmlConverter()
     file->remove();
     delete file;
   }
+
+  foreach ( QString fileName, mKmzFiles + mExportFiles )
+    QFile::remove( fileName );
+
+  // styles documents are named by their content and shared by all converters,
+  // the last one using a document removes it
+  foreach ( QString fileName, mStyleFiles )
+  {
+    if ( --sStyleFileUsers[fileName] <= 0 )
+    {
+      sStyleFileUsers.remove( fileName );
+      QFile::remove( fileName );
+    }
+  }
+
+  foreach ( QString dirName, mTempTileDirs )
+  {
+    QDir tilesDir( dirName );
+    foreach ( QString fileName, tilesDir.entryList( QDir::Files ) )
+      tilesDir.remove( fileName );
+    QDir().rmdir( dirName );
+  }
 }
 
-QString QgsKmlConverter::exportLayerToKmlFile( QgsVectorLayer *vlayer )
+QString QgsKmlConverter::exportLayerToKmlFile( QgsVectorLayer *vlayer, const QString &filter, const QgsRectangle &rect )
 {
   if ( vlayer )
-  {
-    QgsFeatureList featureList;
-    QgsRectangle rect = vlayer->extent();
+    return exportToKmlFile( vlayer->name(), QList<QgsVectorLayer *>() << vlayer, NULL, filter, rect );
+
+  return QString();
+}
+
+QString QgsKmlConverter::exportFeaturesToKmlFile( QgsVectorLayer *vlayer, const QgsFeatureList &flist )
+{
+  return exportToKmlFile( vlayer->name(), QList<QgsVectorLayer *>() << vlayer, &flist );
+}
 
-    QgsApplication::setOverrideCursor( Qt::WaitCursor );
-    vlayer->select( rect, false );
-    featureList = vlayer->selectedFeatures();
-    vlayer->invertSelection();
+// export features of the layer which intersect rect
+QString QgsKmlConverter::exportFeaturesToKmlFile( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance )
+{
+  QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+  QgsFeatureList featureList = layerFeatures( vlayer, rect, vlayer->pendingAllAttributesList(), QString(), true );
+  if ( mCanceled )
+  {
+    // the layer may be gone
     QgsApplication::restoreOverrideCursor();
+    return QString();
+  }
+
+  // placemarks encoded ahead for the same layer and canvas resolution are taken as they are,
+  // resolution in layer units differs slightly over the canvas of a reprojected layer
+  bool cached = vlayer->getLayerID() == mPlacemarkCacheLayerId
+                && qAbs( tolerance - mPlacemarkCacheTolerance ) <= 0.01 * mPlacemarkCacheTolerance;
+  if ( tolerance > 0.0 )
+  {
+    // geometry engine is not thread safe, so simplify here rather than in encoders
+    QSettings settings;
+    int maxVertices = settings.value( "/qgis2google/simplify/maxvertices", 10000 ).toInt();
+    for ( int i = 0; i < featureList.count(); i++ )
+    {
+      if ( !cached || !mPlacemarkCache.contains( featureList.at( i ).id() ) )
+        simplifyFeature( featureList[i], tolerance, maxVertices );
+    }
+  }
+  QgsApplication::restoreOverrideCursor();
+
+  if ( mCanceled || featureList.isEmpty() )
+    return QString();
+
+  mUsePlacemarkCache = cached;
+  QString fileName = exportFeaturesToKmlFile( vlayer, featureList );
+  mUsePlacemarkCache = false;
+  return fileName;
+}
 
-    return exportFeaturesToKmlFile( vlayer, featureList );
+// encode features in rect ahead of a send of features, so the send only gathers
+// placemarks. Features are read between events and encoded in the background, any
+// other request cancels it. Placemarks of features out of rect are dropped and the
+// cache does not grow beyond its limit. Returns false when canceled.
+bool QgsKmlConverter::preEncodeFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance )
+{
+  QList<LayerJob> jobs;
+  QString head = documentHead( vlayer->name(), QList<QgsVectorLayer *>() << vlayer, false, jobs );
+  mIcons.clear();
+  LayerJob &job = jobs.first();
+
+  // merged placemarks depend on the features sent together
+  if ( job.mergeBatchSize > 0 && canMergeFeatures( job ) )
+    return true;
+
+  // styles or options changed
+  QString headHash = QCryptographicHash::hash( head.toUtf8(), QCryptographicHash::Md5 ).toHex();
+  if ( vlayer->getLayerID() != mPlacemarkCacheLayerId || tolerance != mPlacemarkCacheTolerance
+       || headHash != mPlacemarkCacheHead )
+  {
+    clearPlacemarkCache();
+    mPlacemarkCacheLayerId = vlayer->getLayerID();
+    mPlacemarkCacheTolerance = tolerance;
+    mPlacemarkCacheHead = headHash;
   }
-  return QString();
+
+  QSettings settings;
+  int maxVertices = settings.value( "/qgis2google/simplify/maxvertices", 10000 ).toInt();
+
+  // both passes let events in after each interval features read, cached ones too.
+  // Any other request cancels this one before it reads the layer
+  QPointer<QgsVectorLayer> layer( vlayer );
+  int read = 0;
+
+  // ids only are read first to make room for the features in rect
+  QSet<int> rectIds;
+  QgsFeature feature;
+  vlayer->select( QgsAttributeList(), rect, false, false );
+  while ( vlayer->nextFeature( feature ) )
+  {
+    rectIds << feature.id();
+    if ( !yieldRead( ++read, layer ) )
+      return false;
+  }
+
+  QHash<int, QString>::iterator it = mPlacemarkCache.begin();
+  while ( it != mPlacemarkCache.end() )
+  {
+    if ( rectIds.contains( it.key() ) )
+    {
+      ++it;
+    }
+    else
+    {
+      mPlacemarkCacheBytes -= it.value().size() * sizeof( QChar );
+      it = mPlacemarkCache.erase( it );
+    }
+  }
+
+  QgsFeatureList batch;
+  vlayer->select( job.attributes, rect, true, false );
+  while ( mPlacemarkCacheBytes < PLACEMARKCACHESIZE && vlayer->nextFeature( feature ) )
+  {
+    if ( !yieldRead( ++read, layer ) )
+      return false;
+    if ( mPlacemarkCache.contains( feature.id() ) )
+      continue;
+
+    if ( tolerance > 0.0 )
+      simplifyFeature( feature, tolerance, maxVertices );
+    batch << feature;
+
+    if ( batch.count() >= PREENCODEBATCHSIZE )
+    {
+      if ( !cachePlacemarks( job, batch ) )
+        return false;
+      batch.clear();
+    }
+  }
+
+  return batch.isEmpty() || cachePlacemarks( job, batch );
 }
 
-QString QgsKmlConverter::exportFeaturesToKmlFile( QgsVectorLayer *vlayer, const QgsFeatureList &flist )
+// let events in after each interval features, false when the read is canceled
+// or its layer removed meanwhile
+bool QgsKmlConverter::yieldRead( int read, const QPointer<QgsVectorLayer> &layer )
 {
+  if ( mYieldInterval > 0 && read % mYieldInterval == 0 )
+  {
+    QCoreApplication::processEvents();
+    if ( !layer )
+      mCanceled = true;
+  }
+  return !mCanceled;
+}
+
+// features are encoded while events are processed, placemarks of features edited
+// meanwhile are not cached
+bool QgsKmlConverter::cachePlacemarks( LayerJob &job, const QgsFeatureList &features )
+{
+  if ( job.decimals == 0 )
+    job.decimals = sourceDecimals( features );
+
+  int edits = mPlacemarkCacheEdits;
+  job.features = features;
+  QFuture<QStringList> future = QtConcurrent::run( this, &QgsKmlConverter::featurePlacemarks, job );
+  job.features.clear();
+
+  QCoreApplication::processEvents();
+  QStringList placemarks = future.result();
+  if ( mCanceled )
+    return false;
+  if ( edits != mPlacemarkCacheEdits )
+    return true;
+
+  for ( int i = 0; i < features.count(); i++ )
+  {
+    mPlacemarkCache.insert( features.at( i ).id(), placemarks.at( i ) );
+    mPlacemarkCacheBytes += placemarks.at( i ).size() * sizeof( QChar );
+  }
+  return true;
+}
+
+void QgsKmlConverter::forgetPlacemark( int fid )
+{
+  mPlacemarkCacheEdits++;
+  QHash<int, QString>::iterator it = mPlacemarkCache.find( fid );
+  if ( it != mPlacemarkCache.end() )
+  {
+    mPlacemarkCacheBytes -= it.value().size() * sizeof( QChar );
+    mPlacemarkCache.erase( it );
+  }
+}
+
+void QgsKmlConverter::clearPlacemarkCache()
+{
+  mPlacemarkCacheEdits++;
+  mPlacemarkCache.clear();
+  mPlacemarkCacheBytes = 0;
+  mPlacemarkCacheLayerId.clear();
+  mPlacemarkCacheHead.clear();
+}
+
+// sample is encoded and styled as the whole layer would be
+QString QgsKmlConverter::exportLayerPreview( QgsVectorLayer *vlayer )
+{
+  QSettings settings;
+  int maxFeatures = qMax( settings.value( "/qgis2google/preview/features", 1000 ).toInt(), 1 );
+
   QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+  QgsFeatureList featureList = sampleFeatures( vlayer, maxFeatures, PREVIEWTIMELIMIT );
+  QgsApplication::restoreOverrideCursor();
+
+  if ( featureList.isEmpty() )
+    return QString();
+
+  return exportFeaturesToKmlFile( vlayer, featureList );
+}
+
+QString QgsKmlConverter::exportLayersToKmlFile( const QList<QgsVectorLayer *> &layers )
+{
+  if ( layers.isEmpty() )
+    return QString();
+
+  return exportToKmlFile( tr( "Layers" ), layers, NULL );
+}
+
+// Update for the layer exported to layerFileName: changed features are deleted and
+// created again from their current state, so the same update may be applied many
+// times. Writes to fileName or to a new temporary file when it is empty.
+QString QgsKmlConverter::exportLayerUpdate( QgsVectorLayer *vlayer, const QString &layerFileName,
+                                            const QgsFeatureIds &changedIds, const QgsFeatureIds &deletedIds,
+                                            const QString &fileName )
+{
+  QString updateFileName = fileName;
+  if ( updateFileName.isEmpty() )
+  {
+    QFile *tempFile = getTempFile();
+    if ( !tempFile )
+      return QString();
+    updateFileName = tempFile->fileName();
+  }
+
+  QFile updateFile( updateFileName );
+  if ( !updateFile.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+  {
+    QgsLogger::debug( tr( "Unable to open the update file %1" ).arg( updateFileName ) );
+    return QString();
+  }
+
+  QString targetHref = QUrl::fromLocalFile( layerFileName ).toString();
+
+  QString styles;
+  QTextStream stylesOut( &styles );
+  QMap<QString, QString> styleTable;
+  LayerJob job;
+  job.wholeLayer = false;
+  job.inFolder = false;
+  job.idPrefix = "f";
+  job.styleUrlBase = targetHref;
+  prepareLayerJob( vlayer, job, styleTable, stylesOut, stylesOut );
+  job.mergeBatchSize = 0;
+
+  // styles of the layer are in a separate document
+  QSettings settings;
+  if ( settings.value( "/qgis2google/style/external" ).toBool() )
+  {
+    stylesOut.flush();
+    QString stylesFileName = stylesDocument( styles );
+    if ( !stylesFileName.isEmpty() )
+      job.styleUrlBase = QUrl::fromLocalFile( stylesFileName ).toString();
+  }
+
+  // edit buffer of the layer is read as well
+  foreach ( int fid, changedIds )
+  {
+    QgsFeature feature;
+    if ( vlayer->featureAtId( fid, feature, true, true ) )
+      job.features << feature;
+  }
+  if ( job.decimals == 0 )
+    job.decimals = sourceDecimals( job.features );
+
+  QTextStream out( &updateFile );
+  out.setAutoDetectUnicode( false );
+  out.setCodec( QTextCodec::codecForName( "UTF-8" ) );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\"" << endl
+      << "xmlns:gx=\"http://www.google.com/kml/ext/2.2\">" << endl
+      << "<NetworkLinkControl>" << endl
+      << "<Update>" << endl
+      << "<targetHref>" << targetHref << "</targetHref>" << endl;
+
+  if ( !changedIds.isEmpty() || !deletedIds.isEmpty() )
+  {
+    out << "<Delete>" << endl;
+    foreach ( int fid, changedIds + deletedIds )
+      out << "<Placemark targetId=\"" << job.idPrefix << fid << "\"/>" << endl;
+    out << "</Delete>" << endl;
+  }
+
+  if ( !job.features.isEmpty() )
+  {
+    out << "<Create>" << endl
+        << "<Document targetId=\"" << DOCUMENTID << "\">" << endl
+        << placemarksKml( job )
+        << "</Document>" << endl
+        << "</Create>" << endl;
+  }
+
+  out << "</Update>" << endl
+      << "</NetworkLinkControl>" << endl
+      << "</kml>" << endl;
+
+  return updateFileName;
+}
+
+// document with styles, named by hash of the styles so it is written once for
+// each renderer and options and cached by Google Earth
+QString QgsKmlConverter::stylesDocument( const QString &styles )
+{
+  QByteArray hash = QCryptographicHash::hash( styles.toUtf8(), QCryptographicHash::Md5 ).toHex();
+  QString fileName = QDir::tempPath() + "/qgis2google-styles-" + hash + ".kml";
+  // written by this or another converter, unless somebody removed it
+  if ( sStyleFileUsers.value( fileName ) > 0 && QFile::exists( fileName ) )
+  {
+    if ( !mStyleFiles.contains( fileName ) )
+    {
+      mStyleFiles << fileName;
+      sStyleFileUsers[fileName]++;
+    }
+    return fileName;
+  }
+
+  QFile stylesFile( fileName );
+  if ( !stylesFile.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+  {
+    QgsLogger::debug( tr( "Unable to open the styles file %1" ).arg( fileName ) );
+    return QString();
+  }
+
+  QTextStream out( &stylesFile );
+  out.setAutoDetectUnicode( false );
+  out.setCodec( QTextCodec::codecForName( "UTF-8" ) );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\">" << endl
+      << "<Document>" << endl
+      << styles
+      << "</Document>" << endl
+      << "</kml>" << endl;
+
+  if ( !mStyleFiles.contains( fileName ) )
+  {
+    mStyleFiles << fileName;
+    sStyleFileUsers[fileName]++;
+  }
+  return fileName;
+}
+
+// document loading the layer once and its update every refreshInterval seconds
+QString QgsKmlConverter::exportLiveLink( const QString &name, const QString &layerFileName,
+                                         const QString &updateFileName, int refreshInterval )
+{
   QFile *tempFile = getTempFile();
-  if ( !tempFile->exists() )
+  if ( !tempFile )
     return QString();
 
-  // set codec for kml file
-  QTextCodec *codec = QTextCodec::codecForName( "UTF-8" );
   QTextStream out( tempFile );
+  out.setAutoDetectUnicode( false );
+  out.setCodec( QTextCodec::codecForName( "UTF-8" ) );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\">" << endl
+      << "<Document>" << endl
+      << "<name>" << removeEscapeChars( name ) << "</name>" << endl
+      << "<NetworkLink>" << endl
+      << "<name>" << removeEscapeChars( name ) << "</name>" << endl
+      << "<Link>" << endl
+      << "<href>" << QUrl::fromLocalFile( layerFileName ).toString() << "</href>" << endl
+      << "</Link>" << endl
+      << "</NetworkLink>" << endl
+      << "<NetworkLink>" << endl
+      << "<name>" << tr( "Edits" ) << "</name>" << endl
+      << "<Link>" << endl
+      << "<href>" << QUrl::fromLocalFile( updateFileName ).toString() << "</href>" << endl
+      << "<refreshMode>onInterval</refreshMode>" << endl
+      << "<refreshInterval>" << refreshInterval << "</refreshInterval>" << endl
+      << "</Link>" << endl
+      << "</NetworkLink>" << endl
+      << "</Document>" << endl
+      << "</kml>" << endl;
+
+  return tempFile->fileName();
+}
+
+// each update goes to a new file, so Google Earth sees a new href and applies it once
+QString QgsKmlConverter::exportUpdateLink( const QString &updateFileName, const QString &fileName )
+{
+  QString linkFileName = fileName;
+  if ( linkFileName.isEmpty() )
+  {
+    QFile *tempFile = getTempFile();
+    if ( !tempFile )
+      return QString();
+    linkFileName = tempFile->fileName();
+  }
+
+  QFile linkFile( linkFileName );
+  if ( !linkFile.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+  {
+    QgsLogger::debug( tr( "Unable to open the update link file %1" ).arg( linkFileName ) );
+    return QString();
+  }
 
+  QTextStream out( &linkFile );
   out.setAutoDetectUnicode( false );
-  out.setCodec( codec );
+  out.setCodec( QTextCodec::codecForName( "UTF-8" ) );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\">" << endl
+      << "<Document>" << endl
+      << "<NetworkLink>" << endl
+      << "<Link>" << endl
+      << "<href>" << QUrl::fromLocalFile( updateFileName ).toString() << "</href>" << endl
+      << "</Link>" << endl
+      << "</NetworkLink>" << endl
+      << "</Document>" << endl
+      << "</kml>" << endl;
+
+  return linkFileName;
+}
+
+// write kml document with features of the layers, when flist is not NULL it holds
+// features of the only layer, otherwise features matching filter are read from
+// rect (or whole extent) of the layers. Several layers are written each to its own folder.
+QString QgsKmlConverter::exportToKmlFile( const QString &documentName, const QList<QgsVectorLayer *> &layers,
+                                          const QgsFeatureList *flist, const QString &filter,
+                                          const QgsRectangle &rect )
+{
+  mScannedFeatures = 0;
+  mExportedFeatures = 0;
+  mPlacemarks = 0;
+  mFilterPushedDown = false;
+  QTime exportTime;
+  exportTime.start();
+
+  QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+
+  QList<LayerJob> jobs;
+  QString head = documentHead( documentName, layers, flist == NULL, jobs );
+
+  // placemarks were encoded ahead with the same styles
+  if ( mUsePlacemarkCache && jobs.count() == 1
+       && QCryptographicHash::hash( head.toUtf8(), QCryptographicHash::Md5 ).toHex() == mPlacemarkCacheHead )
+    jobs.first().placemarkCache = mPlacemarkCache;
+
+  // size estimated by the caller for the whole layer, the file is allocated at once
+  qint64 expectedBytes = 0;
+  if ( !flist && filter.isEmpty() && rect.isEmpty() )
+    expectedBytes = mExpectedBytes;
+
+  // export of one layer may be resumed after a crash or cancel, clusters
+  // need all points of the layer at once
+  QSettings settings;
+  QString fileName;
+  if ( !flist && layers.count() == 1 && jobs.first().clusterLevels == 0
+       && settings.value( "/qgis2google/checkpoint/enabled" ).toBool() )
+    fileName = writeLayerWithCheckpoints( layers.first(), jobs.first(), head, filter, rect, expectedBytes );
+  else
+    fileName = writeLayers( layers, jobs, head, flist, filter, rect, expectedBytes );
+
+  mExportTime = exportTime.elapsed();
+  QgsApplication::restoreOverrideCursor();
+
+  if ( mCanceled || fileName.isEmpty() )
+    return QString();
+
+  // point symbols were rendered, they go with the document to kmz
+  if ( !mIcons.isEmpty() )
+    return packKmz( fileName );
+
+  return fileName;
+}
+
+// beginning of the document with styles and schemas of the layers, jobs of the layers are prepared
+QString QgsKmlConverter::documentHead( const QString &documentName, const QList<QgsVectorLayer *> &layers,
+                                       bool wholeLayers, QList<LayerJob> &jobs )
+{
+  QString head;
+  QTextStream out( &head );
 
   out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
       << "<kml xmlns=\"http://earth.google.com/kml/2.2\"" << endl
       << "xmlns:gx=\"http://www.google.com/kml/ext/2.2\">" << endl;
 
-  out << "<Document>" << endl
-      << "<name>" << removeEscapeChars( vlayer->name() ) << "</name>" << endl;
-
-  const QgsRenderer *renderer = vlayer->renderer();
-  QList< QgsSymbol *> symbols = renderer->symbols();
-  QString styleId = "styleOf-" + vlayer->name();
-  bool bSingleSymbol = renderer->name() == "Single Symbol";
-  bool bUniqueValue = renderer->name() == "Unique Value";
+  out << "<Document id=\"" << DOCUMENTID << "\">" << endl
+      << "<name>" << removeEscapeChars( documentName ) << "</name>" << endl;
 
+  // shared style table and schemas go first, equal styles of different layers are written once.
+  // External styles go to a document cached by Google Earth, so repeated sends stay small
   QSettings settings;
-  bool bOverideUniqueValue = settings.value( "/qgis2google/overridelayerstyle" ).toBool();
-  if ( bOverideUniqueValue )
+  bool embedIcons = settings.value( "/qgis2google/icon/embed" ).toBool();
+  // icons in kmz can not be reached from the shared styles document
+  bool externalStyles = settings.value( "/qgis2google/style/external" ).toBool() && !embedIcons && !mInlineStyles;
+  QString styles;
+  QTextStream stylesOut( &styles );
+  QMap<QString, QString> styleTable;
+  mIcons.clear();
+  mEmbedIcons = embedIcons;
+  foreach ( QgsVectorLayer *vlayer, layers )
   {
-    bSingleSymbol = true;
-    bUniqueValue = false;
+    LayerJob job;
+    job.wholeLayer = wholeLayers;
+    job.inFolder = layers.count() > 1;
+    job.idPrefix = job.inFolder ? QString( "layer%1%2f" ).arg( jobs.count() ).arg( STYLEIDDELIMIT ) : QString( "f" );
+    prepareLayerJob( vlayer, job, styleTable, externalStyles ? stylesOut : out, out );
+    jobs << job;
   }
+  mEmbedIcons = false;
 
-  QString kmlStyle;
-  if ( bSingleSymbol )
+  if ( externalStyles )
   {
-    QList<QgsSymbol *> symbols = vlayer->renderer()->symbols();
-    // read default values for kml from symbology
-    QgsSymbol *symbol = symbols.first();
-    // create style kml for one symbol
-    if ( symbol )
-      out << styleKmlSingleSymbol( vlayer->getTransparency(), symbol, styleId, vlayer->geometryType() ) << endl;
+    stylesOut.flush();
+    if ( mCompact )
+      styles = compactKml( styles );
+    QString stylesFileName = stylesDocument( styles );
+    if ( stylesFileName.isEmpty() )
+    {
+      out << styles;
+    }
+    else
+    {
+      // both documents are in the temporary directory
+      for ( int i = 0; i < jobs.count(); i++ )
+        jobs[i].styleUrlBase = QFileInfo( stylesFileName ).fileName();
+    }
   }
-  else if ( bUniqueValue )
+
+  out.flush();
+  return mCompact ? compactKml( head ) : head;
+}
+
+// write the document to a new temporary file
+QString QgsKmlConverter::writeLayers( const QList<QgsVectorLayer *> &layers, QList<LayerJob> &jobs,
+                                      const QString &head, const QgsFeatureList *flist, const QString &filter,
+                                      const QgsRectangle &rect, qint64 expectedBytes )
+{
+  QFile *tempFile = getTempFile();
+  if ( !tempFile || !tempFile->exists() )
+    return QString();
+
+  // kml is written by another thread while features are read and encoded
+  QgsKmlFileWriter writer( tempFile, expectedBytes );
+  writer.write( head.toUtf8() );
+
+  // features are read in this thread (providers are not thread safe) while the layers
+  // read before are encoded in the background, folders are written in layers order
+  // as soon as they are ready
+  QList< QFuture<QString> > folders;
+  for ( int i = 0; i < layers.count(); i++ )
+  {
+    LayerJob &job = jobs[i];
+    if ( flist )
+    {
+      job.features = *flist;
+    }
+    else if ( !filter.isEmpty() || !rect.isEmpty() || !readShapefileFeatures( layers.at( i ), job ) )
+    {
+      // geometries written by the database do not have to be read from the provider
+      bool pushedDown = readDatabaseGeometries( layers.at( i ), job, filter, rect );
+      if ( mCanceled )
+        break;
+      job.features = layerFeatures( layers.at( i ), rect.isEmpty() ? layers.at( i )->extent() : rect,
+                                    job.attributes, filter, !rect.isEmpty(), !pushedDown );
+    }
+    if ( mCanceled )
+      break;
+    if ( job.decimals == 0 )
+      job.decimals = sourceDecimals( job.features );
+
+    // encoded folders wait for the ones before them, reading waits when too many are held
+    while ( folders.count() >= QThread::idealThreadCount() )
+      writeFolder( writer, folders.takeFirst().result() );
+
+    folders << QtConcurrent::run( this, &QgsKmlConverter::placemarksKml, job );
+    job.features.clear();
+    job.geometryKml.clear();
+
+    while ( !folders.isEmpty() && folders.first().isFinished() )
+      writeFolder( writer, folders.takeFirst().result() );
+  }
+
+  while ( !folders.isEmpty() )
+    writeFolder( writer, folders.takeFirst().result() );
+
+  writer.write( QByteArray( "</Document>\n</kml>\n" ) );
+  if ( !writer.finish() )
+    QgsLogger::warning( tr( "Unable to write the temprory file %1" ).arg( tempFile->fileName() ) );
+
+  mWriterStallTime = writer.stallTime();
+  mWriterIdleTime = writer.idleTime();
+  return tempFile->fileName();
+}
+
+// write the layer in chunks of features to a file named after the layer, filter,
+// options and styles. A checkpoint is saved whenever the disk has got another chunk,
+// the next export of the same layer continues after the last checkpoint if the
+// kml still ends as the checkpoint says and the layer gives the same features before it.
+QString QgsKmlConverter::writeLayerWithCheckpoints( QgsVectorLayer *vlayer, LayerJob &job, const QString &head,
+                                                    const QString &filter, const QgsRectangle &rect,
+                                                    qint64 expectedBytes )
+{
+  // external styles are not in the head, their document is named by their hash
+  QString key = QCryptographicHash::hash( ( vlayer->source() + "|" + filter + "|" + rect.toString() + "|"
+                                            + optionsFingerprint() + "|" + QString::number( mStrategy ) + "|"
+                                            + job.styleUrlBase + "|" + head ).toUtf8(),
+                                          QCryptographicHash::Md5 ).toHex();
+  QString fileName = QDir::tempPath() + "/qgis2google-export-" + key + ".kml";
+  QgsKmlExportCheckpoint checkpoint( fileName, key );
+
+  QgsFeatureList features = layerFeatures( vlayer, rect.isEmpty() ? vlayer->extent() : rect,
+                                           job.attributes, filter, !rect.isEmpty() );
+  if ( mCanceled )
+    return QString();
+  if ( job.decimals == 0 )
+    job.decimals = sourceDecimals( features );
+
+  QFile file( fileName );
+  int written = 0;
+  if ( checkpoint.load() && checkpoint.features() <= features.count()
+       && features.at( checkpoint.features() - 1 ).id() == checkpoint.lastFeatureId()
+       && file.open( QIODevice::ReadWrite ) && file.resize( checkpoint.offset() ) && file.seek( checkpoint.offset() ) )
+  {
+    written = checkpoint.features();
+    QgsLogger::debug( tr( "Resuming export of %1 after %2 features" ).arg( vlayer->name() ).arg( written ) );
+  }
+  else
+  {
+    file.close();
+    checkpoint.remove();
+    if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    {
+      QgsLogger::warning( tr( "Unable to open the temprory file %1" ).arg( fileName ) );
+      return QString();
+    }
+  }
+  mExportFiles.removeAll( fileName );
+
+  // estimate of the whole kml says nothing about the part left after a checkpoint
+  QgsKmlFileWriter writer( &file, written == 0 ? expectedBytes : 0 );
+  qint64 offset = file.pos();
+  if ( written == 0 )
+  {
+    QByteArray bytes = head.toUtf8();
+    writer.write( bytes );
+    offset += bytes.size();
+  }
+
+  // chunks are encoded in parallel and written in order, only a few of them wait
+  // in memory. Ends of the chunks in the kml wait until the disk gets there.
+  QList< QFuture<QString> > chunks;
+  QList<int> chunkEnds;
+  QList< QPair<qint64, int> > unsaved;
+  int next = written;
+  while ( next < features.count() || !chunks.isEmpty() )
+  {
+    while ( next < features.count() && chunks.count() < 2 * QThread::idealThreadCount() )
+    {
+      LayerJob chunk = job;
+      copyRuleFilters( chunk );
+      chunk.features = features.mid( next, CHECKPOINTFEATURES );
+      next += chunk.features.count();
+      chunks << QtConcurrent::run( this, &QgsKmlConverter::placemarksKml, chunk );
+      chunkEnds << next;
+    }
+
+    offset += writeFolder( writer, chunks.takeFirst().result() );
+    unsaved << qMakePair( offset, chunkEnds.takeFirst() );
+
+    QPair<qint64, int> saved( 0, 0 );
+    qint64 diskOffset = writer.writtenBytes();
+    while ( !unsaved.isEmpty() && unsaved.first().first <= diskOffset )
+      saved = unsaved.takeFirst();
+    if ( saved.second > 0 )
+      checkpoint.save( saved.second, features.at( saved.second - 1 ).id(), saved.first );
+
+    // a cancel keeps the checkpoint
+    if ( mYieldInterval > 0 )
+      QCoreApplication::processEvents();
+    if ( mCanceled )
+      break;
+  }
+
+  if ( mCanceled )
+  {
+    foreach ( QFuture<QString> chunk, chunks )
+      chunk.waitForFinished();
+    writer.finish();
+    if ( !unsaved.isEmpty() )
+      checkpoint.save( unsaved.last().second, features.at( unsaved.last().second - 1 ).id(), unsaved.last().first );
+    return QString();
+  }
+
+  writer.write( QByteArray( "</Document>\n</kml>\n" ) );
+  if ( !writer.finish() )
+  {
+    QgsLogger::warning( tr( "Unable to write the temprory file %1" ).arg( fileName ) );
+    return QString();
+  }
+  checkpoint.remove();
+
+  // finished kml is removed with the other temporary files
+  mExportFiles << fileName;
+  mWriterStallTime = writer.stallTime();
+  mWriterIdleTime = writer.idleTime();
+  return fileName;
+}
+
+// read a sample from the beginning of the layer, encode it the usual way and
+// extrapolate to the feature count known by the provider
+QgsKmlConverter::ExportEstimate QgsKmlConverter::estimateLayerExport( QgsVectorLayer *vlayer )
+{
+  ExportEstimate estimate;
+  estimate.featureCount = vlayer->featureCount();
+  estimate.vertices = 0;
+  estimate.bytes = 0;
+  estimate.msecs = 0;
+  estimate.strategy = PlainKml;
+
+  QString styles;
+  QTextStream stylesOut( &styles );
+  QMap<QString, QString> styleTable;
+  LayerJob job;
+  job.wholeLayer = false;
+  job.inFolder = false;
+  job.idPrefix = "f";
+  prepareLayerJob( vlayer, job, styleTable, stylesOut, stylesOut );
+  job.mergeBatchSize = 0;
+
+  QTime sampleTime;
+  sampleTime.start();
+
+  QgsFeature feature;
+  qint64 wkbBytes = 0;
+  vlayer->select( job.attributes, QgsRectangle(), true, false );
+  while ( job.features.count() < ESTIMATESAMPLESIZE && vlayer->nextFeature( feature ) )
+  {
+    if ( feature.geometry() )
+      wkbBytes += feature.geometry()->wkbSize();
+    job.features << feature;
+  }
+
+  int sampled = job.features.count();
+  if ( sampled == 0 )
+    return estimate;
+  if ( job.decimals == 0 )
+    job.decimals = sourceDecimals( job.features );
+
+  qint64 sampleBytes = placemarksKml( job ).toUtf8().size();
+  double scale = double( qMax( estimate.featureCount, long( sampled ) ) ) / sampled;
+
+  // two doubles per vertex in wkb
+  estimate.vertices = qint64( wkbBytes / 16 * scale );
+  estimate.bytes = qint64( styles.toUtf8().size() + sampleBytes * scale );
+  estimate.msecs = int( sampleTime.elapsed() * scale );
+
+  if ( estimate.bytes > ESTIMATEMAXBYTES )
+    estimate.strategy = RasterTiles;
+  else if ( estimate.featureCount > ESTIMATEMAXPLACEMARKS && vlayer->geometryType() == QGis::Point )
+    estimate.strategy = ClusteredKml;
+  else if ( estimate.featureCount > ESTIMATEMAXPLACEMARKS && canMergeFeatures( job ) )
+    estimate.strategy = MergedKml;
+
+  return estimate;
+}
+
+QString QgsKmlConverter::strategyDescription( ExportStrategy strategy )
+{
+  switch ( strategy )
+  {
+  case MergedKml:
+    return tr( "merge features of the same style" );
+  case ClusteredKml:
+    return tr( "cluster points" );
+  case RasterTiles:
+    return tr( "send layer as raster tiles" );
+  case PlainKml:
+    break;
+  }
+  return tr( "plain kml" );
+}
+
+// simplify geometry to tolerance, tolerance grows while the geometry has more than maxVertices
+void QgsKmlConverter::simplifyFeature( QgsFeature &feature, double tolerance, int maxVertices )
+{
+  QgsGeometry *geometry = feature.geometry();
+  if ( !geometry || geometry->type() == QGis::Point )
+    return;
+
+  // simplification keeps rings of at least 4 vertices, so a geometry of many parts may never
+  // get under the limit. Tolerance stops growing when it does not remove more vertices
+  QgsGeometry *simplified = geometry->simplify( tolerance );
+  int vertices = simplified ? vertexCount( simplified ) : 0;
+  for ( int i = 0; simplified && maxVertices > 0 && vertices > maxVertices && i < SIMPLIFYMAXSTEPS; i++ )
+  {
+    tolerance *= 2;
+    QgsGeometry *coarser = geometry->simplify( tolerance );
+    int coarserVertices = coarser ? vertexCount( coarser ) : 0;
+    if ( !coarser || coarserVertices >= vertices )
+    {
+      delete coarser;
+      break;
+    }
+    delete simplified;
+    simplified = coarser;
+    vertices = coarserVertices;
+  }
+
+  // keep original when simplifying failed
+  if ( simplified )
+    feature.setGeometry( simplified );
+}
+
+int QgsKmlConverter::vertexCount( QgsGeometry *geometry ) const
+{
+  int count = 0;
+  switch ( geometry->wkbType() )
+  {
+  case QGis::WKBLineString25D:
+  case QGis::WKBLineString:
+    return geometry->asPolyline().count();
+  case QGis::WKBPolygon25D:
+  case QGis::WKBPolygon:
+    foreach ( const QgsPolyline &ring, geometry->asPolygon() )
+      count += ring.count();
+    return count;
+  case QGis::WKBMultiLineString25D:
+  case QGis::WKBMultiLineString:
+    foreach ( const QgsPolyline &line, geometry->asMultiPolyline() )
+      count += line.count();
+    return count;
+  case QGis::WKBMultiPolygon25D:
+  case QGis::WKBMultiPolygon:
+    foreach ( const QgsPolygon &polygon, geometry->asMultiPolygon() )
+    {
+      foreach ( const QgsPolyline &ring, polygon )
+        count += ring.count();
+    }
+    return count;
+  case QGis::WKBMultiPoint25D:
+  case QGis::WKBMultiPoint:
+    return geometry->asMultiPoint().count();
+  default:
+    return 1;
+  }
+}
+
+// viewer load time depends mostly on the number of placemarks, so count them.
+// Folder goes to the writer in chunks, so it is not held twice as utf-8
+qint64 QgsKmlConverter::writeFolder( QgsKmlFileWriter &writer, const QString &folder )
+{
+  mPlacemarks += folder.count( "<Placemark" );
+  qint64 written = 0;
+  int offset = 0;
+  while ( offset < folder.size() )
+  {
+    int size = qMin( FOLDERWRITECHUNK, folder.size() - offset );
+    // surrogate pairs are not split between chunks
+    if ( offset + size < folder.size() && folder.at( offset + size - 1 ).isHighSurrogate() )
+      size++;
+    QByteArray bytes = folder.mid( offset, size ).toUtf8();
+    writer.write( bytes );
+    written += bytes.size();
+    offset += size;
+  }
+  return written;
+}
+
+static int greatestCommonDivisor( int a, int b )
+{
+  while ( b != 0 )
+  {
+    int rest = a % b;
+    a = b;
+    b = rest;
+  }
+  return a;
+}
+
+// pick the first feature of each cell of a square grid over the layer extent
+// through the spatial index of the provider. Cells are visited with a stride
+// coprime to their count, so features read before the time limit are spread
+// over the whole extent.
+QgsFeatureList QgsKmlConverter::sampleFeatures( QgsVectorLayer *vlayer, int maxFeatures, int timeLimit )
+{
+  QgsFeatureList featureList;
+  QgsRectangle extent = vlayer->extent();
+  if ( extent.isEmpty() )
+    return featureList;
+
+  int side = 1;
+  while ( side * side < maxFeatures )
+    side++;
+  int cells = side * side;
+  int stride = qMax( int( cells * 0.618 ), 1 );
+  while ( cells > 1 && greatestCommonDivisor( stride, cells ) != 1 )
+    stride++;
+
+  double cellWidth = extent.width() / side;
+  double cellHeight = extent.height() / side;
+  QgsAttributeList attributes = vlayer->pendingAllAttributesList();
+  QSet<int> sampledIds;
+  QgsFeature feature;
+
+  QTime time;
+  time.start();
+  for ( int i = 0, cell = 0; i < cells && featureList.count() < maxFeatures; i++, cell = ( cell + stride ) % cells )
+  {
+    if ( time.elapsed() > timeLimit )
+      break;
+
+    double xMin = extent.xMinimum() + ( cell % side ) * cellWidth;
+    double yMin = extent.yMinimum() + ( cell / side ) * cellHeight;
+    vlayer->select( attributes, QgsRectangle( xMin, yMin, xMin + cellWidth, yMin + cellHeight ), true, false );
+
+    // big features lie in many cells
+    while ( vlayer->nextFeature( feature ) )
+    {
+      if ( sampledIds.contains( feature.id() ) )
+        continue;
+      sampledIds << feature.id();
+      featureList << feature;
+      break;
+    }
+  }
+
+  return featureList;
+}
+
+// read features through the provider, layer selection stays untouched.
+// Filter is run as subset string by the provider of an own instance of the layer when
+// the provider supports it, otherwise it is parsed once and evaluated here for each feature.
+// With exact set only features really intersecting rect are read.
+QgsFeatureList QgsKmlConverter::layerFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect,
+                                               const QgsAttributeList &attributes, const QString &filter,
+                                               bool exact, bool fetchGeometry )
+{
+  QgsFeatureList featureList;
+  QgsFeature feature;
+  QgsAttributeList fetchAttributes = attributes;
+  QgsSearchString search;
+  QgsSearchTreeNode *searchTree = NULL;
+
+  // an export letting events in reads its own instance of the layer, so clicks reading the
+  // layer meanwhile neither disturb it nor see the filter pushed to its provider. Edits and
+  // memory layers are only in the shared instance
+  QgsVectorLayer *ownLayer = NULL;
+  if ( ( mYieldInterval > 0 || !filter.isEmpty() ) && !vlayer->isEditable() && vlayer->providerType() != "memory" )
+  {
+    QString subset = vlayer->dataProvider() ? vlayer->dataProvider()->subsetString() : QString();
+    ownLayer = new QgsVectorLayer( vlayer->source(), vlayer->name(), vlayer->providerType() );
+    if ( !ownLayer->isValid() || !ownLayer->dataProvider()
+         || ( ownLayer->dataProvider()->subsetString() != subset
+              && !ownLayer->dataProvider()->setSubsetString( subset ) ) )
+    {
+      delete ownLayer;
+      ownLayer = NULL;
+    }
+  }
+  QgsVectorLayer *reader = ownLayer ? ownLayer : vlayer;
+
+  bool bPushedDown = false;
+  if ( !filter.isEmpty() )
+  {
+    QgsVectorDataProvider *provider = reader->dataProvider();
+    if ( ownLayer && provider->supportsSubsetString() )
+    {
+      QString oldSubset = provider->subsetString();
+      QString subset = oldSubset.isEmpty() ? filter : "(" + oldSubset + ") AND (" + filter + ")";
+      bPushedDown = provider->setSubsetString( subset );
+      if ( !bPushedDown )
+        provider->setSubsetString( oldSubset );
+    }
+
+    if ( !bPushedDown )
+    {
+      // export stops as if canceled, an empty document would look like nothing matched
+      if ( !search.setString( filter ) )
+      {
+        QMessageBox::warning( NULL, tr( "Layer filter" ), tr( "Unable to parse filter %1 of layer %2: %3" )
+                              .arg( filter ).arg( vlayer->name() ).arg( search.parserErrorMsg() ) );
+        mCanceled = true;
+        delete ownLayer;
+        return featureList;
+      }
+      searchTree = search.tree();
+      fetchAttributes = reader->pendingAllAttributesList();
+    }
+  }
+
+  // layer removed while events are processed cancels the export, see QgsKmlExportScheduler
+  QPointer<QgsVectorLayer> layer( vlayer );
+  const QgsFieldMap &fields = reader->pendingFields();
+  int read = 0;
+  // shared instance may be read by others, reading goes on after the features collected
+  QSet<int> readIds;
+  mReadingLayer = ownLayer ? NULL : vlayer;
+  mLayerInterrupted = false;
+  reader->select( fetchAttributes, rect, fetchGeometry, exact );
+  while ( reader->nextFeature( feature ) )
+  {
+    if ( !ownLayer )
+    {
+      if ( readIds.contains( feature.id() ) )
+        continue;
+      readIds << feature.id();
+    }
+
+    read++;
+    if ( mYieldInterval > 0 && read % mYieldInterval == 0 )
+    {
+      // let clicks and other exports in, they may cancel this one or use the layer
+      QCoreApplication::processEvents();
+      if ( !layer )
+        mCanceled = true;
+      if ( mCanceled )
+        break;
+
+      if ( mLayerInterrupted )
+      {
+        mLayerInterrupted = false;
+        reader->select( fetchAttributes, rect, fetchGeometry, exact );
+      }
+    }
+
+    if ( searchTree && !searchTree->checkAgainst( fields, feature.attributeMap() ) )
+      continue;
+
+    featureList << feature;
+  }
+  mReadingLayer = NULL;
+  mScannedFeatures += read;
+  mExportedFeatures += featureList.count();
+  if ( bPushedDown )
+    mFilterPushedDown = true;
+  delete ownLayer;
+
+  return featureList;
+}
+
+// ask PostGIS or SpatiaLite for kml of the geometries, streamed from a cursor between events.
+// Only geometries written the same way as by the encoders are pushed down
+bool QgsKmlConverter::readDatabaseGeometries( QgsVectorLayer *vlayer, LayerJob &job, const QString &filter,
+                                              const QgsRectangle &rect )
+{
+  job.geometryKml.clear();
+
+  QSettings settings;
+  if ( !settings.value( "/qgis2google/database/enabled" ).toBool() || !canPushDownGeometries( job ) )
+    return false;
+
+  QgsKmlDatabaseReader reader( vlayer );
+  if ( !reader.isAvailable() || !reader.select( rect, filter, 6 ) )
+    return false;
+
+  int fid;
+  QString kml;
+  int read = 0;
+  while ( reader.nextGeometry( fid, kml ) )
+  {
+    if ( !kml.isEmpty() )
+      job.geometryKml.insert( fid, kml );
+
+    read++;
+    if ( mYieldInterval > 0 && read % mYieldInterval == 0 )
+    {
+      QCoreApplication::processEvents();
+      if ( mCanceled )
+        break;
+    }
+  }
+
+  // features are read from the provider with geometries instead
+  if ( mCanceled || reader.hasError() )
+  {
+    job.geometryKml.clear();
+    return false;
+  }
+  return true;
+}
+
+// database writes coordinates with 6 decimals and no altitude, clusters need the points
+bool QgsKmlConverter::canPushDownGeometries( const LayerJob &job ) const
+{
+  bool clamped = mPointOptions.altitudeMode == "clampToGround" || mPointOptions.altitudeMode == "clampToSeaFloor";
+  return job.decimals == -1 && job.clusterLevels == 0 && clamped
+         && !mPointOptions.hasZValue && !mLineOptions.hasZValue && !mPolyOptions.hasZValue;
+}
+
+// records of an unedited shapefile without subset are decoded in parallel from the mapped
+// files to the features the provider would give, without going through the provider
+bool QgsKmlConverter::readShapefileFeatures( QgsVectorLayer *vlayer, LayerJob &job )
+{
+  QSettings settings;
+  QgsVectorDataProvider *provider = vlayer->dataProvider();
+  if ( !settings.value( "/qgis2google/shapefile/mapped" ).toBool() || !provider
+       || vlayer->providerType() != "ogr" || vlayer->isEditable() || !provider->subsetString().isEmpty() )
+    return false;
+
+  QString fileName = vlayer->source().section( '|', 0, 0 );
+  if ( !fileName.endsWith( ".shp", Qt::CaseInsensitive ) )
+    return false;
+
+  QgsKmlShapefileReader reader( fileName );
+  if ( !reader.open() )
+    return false;
+
+  // ranges are collected between events, as features read from the provider. The files
+  // stay mapped by the reader if the layer is removed meanwhile
+  QPointer<QgsVectorLayer> layer( vlayer );
+  int rangeSize = mYieldInterval > 0 ? mYieldInterval : reader.featureCount();
+  QList< QFuture<QgsFeatureList> > ranges = reader.readRanges( job.attributes, vlayer->pendingFields(),
+                                                               QTextCodec::codecForName( provider->encoding().toLocal8Bit() ),
+                                                               rangeSize );
+  job.features.clear();
+  while ( !ranges.isEmpty() && !mCanceled )
+  {
+    job.features += ranges.takeFirst().result();
+    if ( mYieldInterval > 0 )
+    {
+      QCoreApplication::processEvents();
+      if ( !layer )
+        mCanceled = true;
+    }
+  }
+
+  if ( mCanceled )
+  {
+    // the caller stops without touching the layer
+    reader.cancel();
+    foreach ( QFuture<QgsFeatureList> range, ranges )
+      range.waitForFinished();
+    job.features.clear();
+    return true;
+  }
+
+  if ( reader.hasError() )
+  {
+    // OGR reads what the reader does not understand
+    QgsLogger::debug( tr( "Shapefile %1 has records which are not decoded, read by the provider" ).arg( fileName ) );
+    job.features.clear();
+    return false;
+  }
+  mScannedFeatures += reader.featureCount();
+  mExportedFeatures += job.features.count();
+  return true;
+}
+
+void QgsKmlConverter::setYieldInterval( int interval )
+{
+  mYieldInterval = interval;
+}
+
+void QgsKmlConverter::setExpectedBytes( qint64 bytes )
+{
+  mExpectedBytes = bytes;
+}
+
+void QgsKmlConverter::setStrategy( ExportStrategy strategy )
+{
+  mStrategy = strategy;
+}
+
+void QgsKmlConverter::setInlineStyles( bool inlineStyles )
+{
+  mInlineStyles = inlineStyles;
+}
+
+void QgsKmlConverter::setCanceled( bool canceled )
+{
+  mCanceled = canceled;
+}
+
+bool QgsKmlConverter::isCanceled() const
+{
+  return mCanceled;
+}
+
+// somebody else read the layer while events were processed
+void QgsKmlConverter::layerInterrupted( QgsVectorLayer *vlayer )
+{
+  if ( vlayer == mReadingLayer )
+    mLayerInterrupted = true;
+}
+
+// hash of all export settings, equal settings give equal output
+QString QgsKmlConverter::optionsFingerprint()
+{
+  QSettings settings;
+  QString options;
+
+  settings.beginGroup( "/qgis2google" );
+  foreach ( QString key, settings.allKeys() )
+  {
+    // dialog geometry does not change the output
+    if ( key == "pos" || key == "size" )
+      continue;
+    options += key + "=" + settings.value( key ).toString() + ";";
+  }
+  settings.endGroup();
+
+  return QCryptographicHash::hash( options.toUtf8(), QCryptographicHash::Md5 ).toHex();
+}
+
+// what the last layer export read and wrote, shows how much filter saved
+QString QgsKmlConverter::exportStatistics() const
+{
+  QString filterInfo = mFilterPushedDown ? tr( "filter run by data provider" ) : tr( "filter evaluated by plugin" );
+
+  // the side waiting longer is faster
+  QString boundInfo = mWriterStallTime > mWriterIdleTime ? tr( "disk-bound" ) : tr( "CPU-bound" );
+  return tr( "%1 features read, %2 exported as %3 placemarks in %4 ms, %5, %6 (%7 ms waited for disk, %8 ms for encoding)" )
+         .arg( mScannedFeatures ).arg( mExportedFeatures ).arg( mPlacemarks ).arg( mExportTime ).arg( filterInfo )
+         .arg( boundInfo ).arg( mWriterStallTime ).arg( mWriterIdleTime );
+}
+
+// render the layer with its symbology to a pyramid of png tiles, each tile is a
+// GroundOverlay in its own kml with Region/Lod and NetworkLinks to its children
+// (super-overlay), so Google Earth loads only tiles needed for the current view
+QString QgsKmlConverter::exportLayerToSuperOverlay( QgsVectorLayer *vlayer )
+{
+  if ( !vlayer )
+    return QString();
+
+  QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+  QFile *tempFile = getTempFile();
+  if ( !tempFile || !tempFile->exists() )
+  {
+    QgsApplication::restoreOverrideCursor();
+    return QString();
+  }
+
+  QSettings settings;
+  int levels = qMax( settings.value( "/qgis2google/superoverlay/levels", 4 ).toInt(), 1 );
+
+  // tiles go to directory next to the root kml
+  QFileInfo rootInfo( tempFile->fileName() );
+  QString tilesDirName = rootInfo.completeBaseName() + "_files";
+  QDir tilesDir( rootInfo.absolutePath() + "/" + tilesDirName );
+  QDir().mkpath( tilesDir.absolutePath() );
+  mTempTileDirs << tilesDir.absolutePath();
+
+  // tiles have to be square for the renderer not to change their extent
+  QgsRectangle extent = vlayer->extent();
+  double side = qMax( extent.width(), extent.height() );
+  if ( side <= 0 )
+    side = 1.0;
+  QgsPoint center = extent.center();
+  QgsRectangle rootRect( center.x() - side / 2, center.y() - side / 2,
+                         center.x() + side / 2, center.y() + side / 2 );
+
+  // providers are not thread safe, so tiles are rendered in this thread
+  // while png encoding and writing go in the background
+  QgsMapRenderer mapRenderer;
+  QImage tileImage( 256, 256, QImage::Format_ARGB32 );
+  mapRenderer.setLayerSet( QStringList() << vlayer->getLayerID() );
+  mapRenderer.setOutputSize( tileImage.size(), tileImage.logicalDpiX() );
+
+  QList< QFuture<bool> > pngs;
+  bool hasTiles = superOverlayTile( vlayer, mapRenderer, tilesDir, rootRect, 0, 0, 0, levels, pngs );
+
+  QTextCodec *codec = QTextCodec::codecForName( "UTF-8" );
+  QTextStream out( tempFile );
+
+  out.setAutoDetectUnicode( false );
+  out.setCodec( codec );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\"" << endl
+      << "xmlns:gx=\"http://www.google.com/kml/ext/2.2\">" << endl;
+
+  out << "<Document>" << endl
+      << "<name>" << removeEscapeChars( vlayer->name() ) << "</name>" << endl;
+  if ( hasTiles )
+  {
+    out << "<NetworkLink>" << endl
+        << "<name>" << removeEscapeChars( vlayer->name() ) << "</name>" << endl
+        << "<Link>" << endl
+        << "<href>" << tilesDirName << "/0_0_0.kml</href>" << endl
+        << "</Link>" << endl
+        << "</NetworkLink>" << endl;
+  }
+  out << "</Document>" << endl
+      << "</kml>" << endl;
+
+  foreach ( QFuture<bool> png, pngs )
+    png.waitForFinished();
+
+  QgsApplication::restoreOverrideCursor();
+  return tempFile->fileName();
+}
+
+// write features of each value of the partition field (or of each unique value class) to its
+// own kml next to the root kml. The root holds styles and a NetworkLink per part, switched off,
+// so Google Earth reads only parts the user turns on. Layer is read once, parts are encoded
+// and written in parallel.
+QString QgsKmlConverter::exportLayerToPartitions( QgsVectorLayer *vlayer )
+{
+  if ( !vlayer )
+    return QString();
+
+  QSettings settings;
+  QString fieldName = settings.value( "/qgis2google/partition/field" ).toString();
+  int partitionField = fieldName.isEmpty() ? -1 : vlayer->fieldNameIndex( fieldName );
+
+  mScannedFeatures = 0;
+  mExportedFeatures = 0;
+  mPlacemarks = 0;
+  mFilterPushedDown = false;
+  QTime exportTime;
+  exportTime.start();
+
+  QgsApplication::setOverrideCursor( QCursor( Qt::WaitCursor ) );
+
+  QList<LayerJob> jobs;
+  QString head = documentHead( vlayer->name(), QList<QgsVectorLayer *>() << vlayer, true, jobs );
+  LayerJob &job = jobs.first();
+
+  // by unique value classes unless a partition field is set
+  bool byClass = partitionField == -1;
+  if ( byClass && job.classification != UniqueValues )
+  {
+    QgsLogger::debug( tr( "Layer %1 has neither partition field nor unique values, exported whole" )
+                      .arg( vlayer->name() ) );
+    QgsApplication::restoreOverrideCursor();
+    return exportLayerToKmlFile( vlayer );
+  }
+  if ( !byClass && !job.attributes.contains( partitionField ) )
+  {
+    job.attributes << partitionField;
+    qSort( job.attributes );
+  }
+
+  QFile *tempFile = getTempFile();
+  if ( !tempFile || !tempFile->exists() )
+  {
+    QgsApplication::restoreOverrideCursor();
+    return QString();
+  }
+
+  // parts go to directory next to the root kml
+  QFileInfo rootInfo( tempFile->fileName() );
+  QString partsDirName = rootInfo.completeBaseName() + "_files";
+  QDir partsDir( rootInfo.absolutePath() + "/" + partsDirName );
+  QDir().mkpath( partsDir.absolutePath() );
+  mTempTileDirs << partsDir.absolutePath();
+
+  // rendered point symbols are referred to by styles of the root
+  for ( QMap<QString, QImage>::const_iterator it = mIcons.constBegin(); it != mIcons.constEnd(); ++it )
+  {
+    QString iconFileName = rootInfo.absolutePath() + "/" + it.key();
+    QDir().mkpath( QFileInfo( iconFileName ).absolutePath() );
+    if ( saveTileImage( it.value(), iconFileName ) )
+      mExportFiles << iconFileName;
+  }
+
+  QgsFeatureList features = layerFeatures( vlayer, vlayer->extent(), job.attributes, QString(), false );
+  if ( mCanceled )
+  {
+    QgsApplication::restoreOverrideCursor();
+    return QString();
+  }
+  if ( job.decimals == 0 )
+    job.decimals = sourceDecimals( features );
+
+  // placemarks of the parts refer to styles of the root or of the shared styles document,
+  // schema is repeated in each part
+  QString partHead;
+  QTextStream partOut( &partHead );
+  LayerJob partJob = job;
+  partJob.inFolder = false;
+  partJob.styleUrlBase = "../" + ( job.styleUrlBase.isEmpty() ? rootInfo.fileName() : job.styleUrlBase );
+  prepareLayerSchema( vlayer, partJob, partOut );
+  partOut.flush();
+
+  // the class is looked up once per feature, the part keeps its style. Features are
+  // moved to their parts, so they are not held twice
+  QMap<QString, LayerJob> parts;
+  while ( !features.isEmpty() )
+  {
+    QgsFeature feature = features.takeFirst();
+    QString value = feature.attributeMap().value( byClass ? job.classificationField : partitionField ).toString();
+    QMap<QString, LayerJob>::iterator part = parts.find( value );
+    if ( part == parts.end() )
+    {
+      part = parts.insert( value, partJob );
+      copyRuleFilters( part.value() );
+      part->name = value.isEmpty() ? tr( "(no value)" ) : value;
+      if ( byClass )
+      {
+        part->presetStyle = true;
+        part->styleId = job.classStyleIds.value( value );
+      }
+    }
+    part->features << feature;
+  }
+
+  QTextCodec *codec = QTextCodec::codecForName( "UTF-8" );
+  QTextStream out( tempFile );
+
+  out.setAutoDetectUnicode( false );
+  out.setCodec( codec );
+
+  out << head;
+
+  // only a few parts are encoded at once, features of a part are released when it is
+  // written. Links go to the root in order of the parts.
+  QList< QFuture<int> > written;
+  QStringList names;
+  QStringList hrefs;
+  int partNumber = 0;
+  QMap<QString, LayerJob>::iterator it = parts.begin();
+  while ( it != parts.end() || !written.isEmpty() )
+  {
+    while ( it != parts.end() && written.count() < QThread::idealThreadCount() )
+    {
+      QString partFileName = QString( "part%1.kml" ).arg( partNumber++ );
+      QString partKml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<kml xmlns=\"http://earth.google.com/kml/2.2\"\n"
+                        "xmlns:gx=\"http://www.google.com/kml/ext/2.2\">\n"
+                        "<Document>\n<name>" + removeEscapeChars( it->name ) + "</name>\n" + partHead;
+      written << QtConcurrent::run( this, &QgsKmlConverter::writePartition, it.value(),
+                                    mCompact ? compactKml( partKml ) : partKml,
+                                    partsDir.absoluteFilePath( partFileName ) );
+      it->features.clear();
+      names << it->name;
+      hrefs << partsDirName + "/" + partFileName;
+      ++it;
+    }
+
+    int placemarks = written.takeFirst().result();
+    QString name = names.takeFirst();
+    QString href = hrefs.takeFirst();
+    if ( placemarks < 0 )
+    {
+      QgsLogger::warning( tr( "Unable to write the temprory file %1" ).arg( href ) );
+      continue;
+    }
+    mPlacemarks += placemarks;
+
+    out << "<NetworkLink>" << endl
+        << "<name>" << removeEscapeChars( name ) << "</name>" << endl
+        << "<visibility>0</visibility>" << endl
+        << "<Link>" << endl
+        << "<href>" << href << "</href>" << endl
+        << "</Link>" << endl
+        << "</NetworkLink>" << endl;
+  }
+  out << "</Document>" << endl
+      << "</kml>" << endl;
+  out.flush();
+
+  mExportTime = exportTime.elapsed();
+  QgsApplication::restoreOverrideCursor();
+  return tempFile->fileName();
+}
+
+int QgsKmlConverter::writePartition( const LayerJob &job, const QString &head, const QString &fileName ) const
+{
+  QString placemarks = placemarksKml( job );
+
+  QFile file( fileName );
+  if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    return -1;
+
+  // pieces are written one by one rather than joined to another copy of the part
+  QByteArray bytes = head.toUtf8();
+  if ( file.write( bytes ) != bytes.size() )
+    return -1;
+  bytes = placemarks.toUtf8();
+  if ( file.write( bytes ) != bytes.size() )
+    return -1;
+  bytes = QByteArray( "</Document>\n</kml>\n" );
+  if ( file.write( bytes ) != bytes.size() )
+    return -1;
+
+  return placemarks.count( "<Placemark" );
+}
+
+// write tile and, recursively, its children, return false for tiles without features
+bool QgsKmlConverter::superOverlayTile( QgsVectorLayer *vlayer, QgsMapRenderer &mapRenderer, const QDir &tilesDir,
+                                        const QgsRectangle &rect, int level, int x, int y, int levels,
+                                        QList< QFuture<bool> > &pngs )
+{
+  // skip empty tiles together with their children
+  QgsFeature feature;
+  vlayer->select( QgsAttributeList(), rect, false, true );
+  if ( !vlayer->nextFeature( feature ) )
+    return false;
+
+  QString tileName = QString( "%1_%2_%3" ).arg( level ).arg( x ).arg( y );
+
+  QImage tileImage( 256, 256, QImage::Format_ARGB32 );
+  tileImage.fill( 0 );
+  QPainter painter( &tileImage );
+  mapRenderer.setExtent( rect );
+  mapRenderer.render( &painter );
+  painter.end();
+  pngs << QtConcurrent::run( this, &QgsKmlConverter::saveTileImage, tileImage,
+                             tilesDir.absoluteFilePath( tileName + ".png" ) );
+
+  // children tiles
+  QString linksKml;
+  if ( level + 1 < levels )
+  {
+    double halfWidth = rect.width() / 2;
+    double halfHeight = rect.height() / 2;
+    for ( int i = 0; i < 4; i++ )
+    {
+      int dx = i % 2;
+      int dy = i / 2;
+      QgsRectangle childRect( rect.xMinimum() + dx * halfWidth, rect.yMinimum() + dy * halfHeight,
+                              rect.xMinimum() + ( dx + 1 ) * halfWidth, rect.yMinimum() + ( dy + 1 ) * halfHeight );
+      int childX = x * 2 + dx;
+      int childY = y * 2 + dy;
+      if ( !superOverlayTile( vlayer, mapRenderer, tilesDir, childRect, level + 1, childX, childY, levels, pngs ) )
+        continue;
+
+      QString childName = QString( "%1_%2_%3" ).arg( level + 1 ).arg( childX ).arg( childY );
+      linksKml += "<NetworkLink>\n"
+                  "<name>" + childName + "</name>\n" +
+                  regionKml( childRect, 128, -1 ) + "\n"
+                  "<Link>\n"
+                  "<href>" + childName + ".kml</href>\n"
+                  "<viewRefreshMode>onRegion</viewRefreshMode>\n"
+                  "</Link>\n"
+                  "</NetworkLink>\n";
+    }
+  }
+
+  QFile tileFile( tilesDir.absoluteFilePath( tileName + ".kml" ) );
+  if ( !tileFile.open( QIODevice::WriteOnly ) )
+  {
+    QgsLogger::debug( tr( "Unable to open the tile file %1" ).arg( tileFile.fileName() ) );
+    return false;
+  }
+
+  QTextStream out( &tileFile );
+  out.setCodec( QTextCodec::codecForName( "UTF-8" ) );
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+      << "<kml xmlns=\"http://earth.google.com/kml/2.2\">" << endl
+      << "<Document>" << endl
+      << "<name>" << tileName << "</name>" << endl
+      << regionKml( rect, 128, level + 1 < levels ? 512 : -1 ) << endl
+      << linksKml
+      << "<GroundOverlay>" << endl
+      << "<drawOrder>" << level << "</drawOrder>" << endl
+      << "<Icon>" << endl
+      << "<href>" << tileName << ".png</href>" << endl
+      << "</Icon>" << endl
+      << "<LatLonBox>" << endl
+      << "<north>" << QString::number( rect.yMaximum(), 'f', 6 ) << "</north>" << endl
+      << "<south>" << QString::number( rect.yMinimum(), 'f', 6 ) << "</south>" << endl
+      << "<east>" << QString::number( rect.xMaximum(), 'f', 6 ) << "</east>" << endl
+      << "<west>" << QString::number( rect.xMinimum(), 'f', 6 ) << "</west>" << endl
+      << "</LatLonBox>" << endl
+      << "</GroundOverlay>" << endl
+      << "</Document>" << endl
+      << "</kml>" << endl;
+
+  return true;
+}
+
+// encode and write tile image, called from worker threads
+bool QgsKmlConverter::saveTileImage( const QImage &image, const QString &fileName ) const
+{
+  return image.save( fileName, "PNG" );
+}
+
+// collect everything the placemarks of the layer need: styles, schema and
+// the attributes which have to be fetched from the provider
+void QgsKmlConverter::prepareLayerJob( QgsVectorLayer *vlayer, LayerJob &job, QMap<QString, QString> &styleTable,
+                                       QTextStream &stylesOut, QTextStream &out )
+{
+  job.name = vlayer->name();
+  job.nameIndex = attributeNameIndex( vlayer );
+  job.descriptionIndex = attributeDescriprionIndex( vlayer );
+  job.classification = SingleStyle;
+  job.classificationField = -1;
+  job.presetStyle = false;
+  job.clusterLevels = 0;
+  job.extent = vlayer->extent();
+  readGeometryOptions();
+
+  prepareLayerStyles( vlayer, job, styleTable, stylesOut );
+  prepareLayerSchema( vlayer, job, out );
+
+  // clustering makes sense only for the whole point layer
+  QSettings settings;
+  if ( job.wholeLayer && vlayer->geometryType() == QGis::Point
+       && ( mStrategy == ClusteredKml || settings.value( "/qgis2google/cluster/enabled" ).toBool() ) )
+  {
+    job.clusterLevels = qMax( settings.value( "/qgis2google/cluster/levels", 4 ).toInt(), 1 );
+    QString styleId = removeEscapeChars( "clusterOf-" + vlayer->name() + STYLEIDDELIMIT );
+    for ( int i = 0; i < 5; i++ )
+      job.clusterStyleIds << registerStyle( styleId + QString::number( i ), clusterStyleKml( i ), styleTable, stylesOut );
+  }
+
+  // templates are kept per layer like filters and compiled once, placemarks only
+  // fill in values of the fields
+  QString templateKey = "/qgis2google/template/layers/" + vlayer->getLayerID();
+  job.nameTemplate = compileTemplate( vlayer, settings.value( templateKey + "/name" ).toString() );
+  job.descriptionTemplate = compileTemplate( vlayer, settings.value( templateKey + "/description" ).toString() );
+  if ( !job.nameTemplate.isEmpty() )
+    job.nameIndex = -1;
+  if ( !job.descriptionTemplate.isEmpty() )
+    job.descriptionIndex = -1;
+
+  // features without own name or description are merged by style to fewer placemarks
+  job.mergeBatchSize = 0;
+  if ( mStrategy == MergedKml || settings.value( "/qgis2google/merge/enabled" ).toBool() )
+    job.mergeBatchSize = qMax( settings.value( "/qgis2google/merge/batchsize", 1000 ).toInt(), 2 );
+
+  // coordinates snapped to the chosen precision or to the precision of the data
+  job.decimals = -1;
+  if ( settings.value( "/qgis2google/quantize/enabled" ).toBool() )
+    job.decimals = qBound( 0, settings.value( "/qgis2google/quantize/decimals", 0 ).toInt(), MAXDECIMALS );
+
+  // fetch only columns which are written to kml
+  QgsAttributeList usedAttributes;
+  if ( job.classificationField > -1 )
+    usedAttributes << job.classificationField;
+  if ( job.classification != UniqueValues )
+    usedAttributes << job.nameIndex;
+  usedAttributes << job.ruleFields << job.descriptionIndex << job.extendedDataFields;
+  foreach ( const TemplateFragment &fragment, job.nameTemplate + job.descriptionTemplate )
+    usedAttributes << fragment.field;
+
+  job.attributes.clear();
+  foreach ( int index, usedAttributes )
+  {
+    if ( index > -1 && !job.attributes.contains( index ) )
+      job.attributes << index;
+  }
+  qSort( job.attributes );
+}
+
+// split template like <b>[% "owner" %]</b> to literal text and field references,
+// field names are looked up here once for the whole export
+QgsKmlConverter::CompiledTemplate QgsKmlConverter::compileTemplate( QgsVectorLayer *vlayer, const QString &text )
+{
+  CompiledTemplate compiled;
+  QRegExp fieldRx( "\\[%\\s*\"?([^\"%]*)\"?\\s*%\\]" );
+
+  int pos = 0;
+  while ( pos < text.length() )
+  {
+    int fieldPos = fieldRx.indexIn( text, pos );
+    int literalEnd = fieldPos == -1 ? text.length() : fieldPos;
+    if ( literalEnd > pos )
+    {
+      TemplateFragment literal = { text.mid( pos, literalEnd - pos ), -1 };
+      compiled << literal;
+    }
+    if ( fieldPos == -1 )
+      break;
+
+    // unknown field gives empty value
+    TemplateFragment field = { QString(), vlayer->fieldNameIndex( fieldRx.cap( 1 ).trimmed() ) };
+    if ( field.field > -1 )
+      compiled << field;
+    pos = fieldPos + fieldRx.matchedLength();
+  }
+  return compiled;
+}
+
+// fill template with attribute values of the feature
+QString QgsKmlConverter::expandTemplate( const CompiledTemplate &compiled, const QgsAttributeMap &attrMap ) const
+{
+  QString result;
+  for ( int i = 0; i < compiled.count(); i++ )
+  {
+    const TemplateFragment &fragment = compiled.at( i );
+    if ( fragment.field == -1 )
+      result += fragment.text;
+    else
+      result += attrMap.value( fragment.field ).toString();
+  }
+  return result;
+}
+
+// write kml schema for the attributes chosen for ExtendedData
+void QgsKmlConverter::prepareLayerSchema( QgsVectorLayer *vlayer, LayerJob &job, QTextStream &out )
+{
+  job.extendedDataFields.clear();
+  job.extendedDataNames.clear();
+
+  QSettings settings;
+  if ( !settings.value( "/qgis2google/extendeddata/enabled" ).toBool() )
+    return;
+
+  QStringList fieldNames = settings.value( "/qgis2google/extendeddata/fields" ).toStringList();
+  const QgsFieldMap &fields = vlayer->pendingFields();
+  QString schemaKml;
+  for ( QgsFieldMap::const_iterator it = fields.constBegin(); it != fields.constEnd(); ++it )
+  {
+    if ( !fieldNames.contains( it->name() ) )
+      continue;
+
+    QString name = Qt::escape( it->name() );
+    job.extendedDataFields << it.key();
+    job.extendedDataNames << name;
+    schemaKml += "<SimpleField type=\"" + kmlFieldType( it->type() ) + "\" name=\"" + name + "\"></SimpleField>\n";
+  }
+
+  if ( job.extendedDataFields.isEmpty() )
+    return;
+
+  job.schemaId = "schemaOf-" + Qt::escape( vlayer->getLayerID() );
+  out << "<Schema name=\"" << Qt::escape( vlayer->name() ) << "\" id=\"" << job.schemaId << "\">" << endl
+      << schemaKml
+      << "</Schema>" << endl;
+}
+
+// kml name of the type for SimpleField
+QString QgsKmlConverter::kmlFieldType( QVariant::Type type )
+{
+  switch ( type )
+  {
+  case QVariant::Int:
+    return "int";
+  case QVariant::UInt:
+    return "uint";
+  case QVariant::Double:
+    return "double";
+  case QVariant::Bool:
+    return "bool";
+  default:
+    return "string";
+  }
+}
+
+// find out which styles the layer needs, write new ones to the style table
+// and remember style ids for placemarks of the layer
+void QgsKmlConverter::prepareLayerStyles( QgsVectorLayer *vlayer, LayerJob &job,
+                                          QMap<QString, QString> &styleTable, QTextStream &out )
+{
+  if ( vlayer->isUsingRendererV2() )
+  {
+    prepareLayerStylesV2( vlayer, job, styleTable, out );
+    return;
+  }
+
+  const QgsRenderer *renderer = vlayer->renderer();
+  if ( !renderer )
+    return;
+
+  QList< QgsSymbol *> symbols = renderer->symbols();
+  QString styleId = "styleOf-" + vlayer->name();
+  bool bSingleSymbol = renderer->name() == "Single Symbol";
+  bool bUniqueValue = renderer->name() == "Unique Value";
+
+  QSettings settings;
+  bool bOverideUniqueValue = settings.value( "/qgis2google/overridelayerstyle" ).toBool();
+  if ( bOverideUniqueValue )
+  {
+    bSingleSymbol = true;
+    bUniqueValue = false;
+  }
+
+  if ( bSingleSymbol )
+  {
+    // read default values for kml from symbology
+    QgsSymbol *symbol = symbols.isEmpty() ? NULL : symbols.first();
+    // create style kml for one symbol
+    if ( symbol )
+    {
+      QString styleBody = styleKmlSymbol( vlayer->getTransparency(), symbol, bOverideUniqueValue );
+      job.styleId = registerStyle( removeEscapeChars( styleId ), styleBody, styleTable, out );
+    }
+  }
+  else if ( bUniqueValue )
+  {
+    const QgsUniqueValueRenderer *urenderer = dynamic_cast<const QgsUniqueValueRenderer *>( renderer );
+    job.classification = UniqueValues;
+    job.classificationField = urenderer->classificationField();
+
+    // create style kml for many symbols
+    foreach( QgsSymbol *symbol, symbols )
+    {
+      QString uniqStyleId = featureStyleId( symbol, styleId );
+      if ( uniqStyleId.isEmpty() )
+        continue;
+
+      QString styleBody = styleKmlSymbol( vlayer->getTransparency(), symbol, false );
+      job.classStyleIds.insert( symbol->lowerValue(), registerStyle( uniqStyleId, styleBody, styleTable, out ) );
+    }
+  }
+  else
+  {
+    // dont process other renderers symbols
+  }
+}
+
+// classes of renderer-v2 are put to lookup tables once per export: categories
+// to a hash, graduated ranges are sorted for binary search
+void QgsKmlConverter::prepareLayerStylesV2( QgsVectorLayer *vlayer, LayerJob &job,
+                                            QMap<QString, QString> &styleTable, QTextStream &out )
+{
+  QgsFeatureRendererV2 *renderer = vlayer->rendererV2();
+  if ( !renderer )
+    return;
+
+  QString styleId = "styleOf-" + vlayer->name();
+
+  QSettings settings;
+  if ( settings.value( "/qgis2google/overridelayerstyle" ).toBool() )
+  {
+    // style is made of plugin settings only
+    QgsSymbol symbol( vlayer->geometryType() );
+    QString styleBody = styleKmlSymbol( 255, &symbol, true );
+    job.styleId = registerStyle( removeEscapeChars( styleId ), styleBody, styleTable, out );
+    return;
+  }
+
+  QgsSingleSymbolRendererV2 *singleRenderer = dynamic_cast<QgsSingleSymbolRendererV2 *>( renderer );
+  QgsCategorizedSymbolRendererV2 *categorizedRenderer = dynamic_cast<QgsCategorizedSymbolRendererV2 *>( renderer );
+  QgsGraduatedSymbolRendererV2 *graduatedRenderer = dynamic_cast<QgsGraduatedSymbolRendererV2 *>( renderer );
+  QgsRuleBasedRendererV2 *ruleRenderer = dynamic_cast<QgsRuleBasedRendererV2 *>( renderer );
+
+  if ( singleRenderer )
+  {
+    if ( singleRenderer->symbol() )
+    {
+      QString styleBody = styleKmlSymbolV2( singleRenderer->symbol() );
+      job.styleId = registerStyle( removeEscapeChars( styleId ), styleBody, styleTable, out );
+    }
+  }
+  else if ( categorizedRenderer )
+  {
+    job.classification = UniqueValues;
+    job.classificationField = vlayer->fieldNameIndex( categorizedRenderer->classAttribute() );
+
+    const QgsCategoryList &categories = categorizedRenderer->categories();
+    for ( int i = 0; i < categories.count(); i++ )
+    {
+      const QgsRendererCategoryV2 &category = categories.at( i );
+      if ( !category.symbol() )
+        continue;
+
+      QString value = category.value().toString();
+      QString styleBody = styleKmlSymbolV2( category.symbol() );
+      QString classStyleId = removeEscapeChars( styleId + STYLEIDDELIMIT + value );
+      job.classStyleIds.insert( value, registerStyle( classStyleId, styleBody, styleTable, out ) );
+    }
+  }
+  else if ( graduatedRenderer )
+  {
+    job.classification = ValueRanges;
+    job.classificationField = vlayer->fieldNameIndex( graduatedRenderer->classAttribute() );
+
+    // order ranges by upper value
+    const QgsRangeList &ranges = graduatedRenderer->ranges();
+    QMap<double, int> order;
+    for ( int i = 0; i < ranges.count(); i++ )
+    {
+      if ( ranges.at( i ).symbol() )
+        order.insertMulti( ranges.at( i ).upperValue(), i );
+    }
+
+    QMap<double, int>::const_iterator it = order.constBegin();
+    for ( ; it != order.constEnd(); ++it )
+    {
+      const QgsRendererRangeV2 &range = ranges.at( it.value() );
+      QString styleBody = styleKmlSymbolV2( range.symbol() );
+      QString rangeStyleId = removeEscapeChars( styleId + STYLEIDDELIMIT + QString::number( range.lowerValue() )
+                                                + "-" + QString::number( range.upperValue() ) );
+      job.rangeLowerValues << range.lowerValue();
+      job.rangeUpperValues << range.upperValue();
+      job.rangeStyleIds << registerStyle( rangeStyleId, styleBody, styleTable, out );
+    }
+  }
+  else if ( ruleRenderer )
+  {
+    job.classification = Rules;
+    job.fields = vlayer->pendingFields();
+
+    // filters are parsed once, feature gets style of the first rule it matches
+    for ( int i = 0; i < ruleRenderer->ruleCount(); i++ )
+    {
+      QgsRuleBasedRendererV2::Rule &rule = ruleRenderer->ruleAt( i );
+      if ( !rule.symbol() )
+        continue;
+
+      QSharedPointer<QgsSearchString> filter( new QgsSearchString );
+      if ( !rule.filterExpression().isEmpty() )
+      {
+        if ( !filter->setString( rule.filterExpression() ) )
+        {
+          QgsLogger::warning( tr( "Unable to parse filter %1: %2" ).arg( rule.filterExpression() ).arg( filter->parserErrorMsg() ) );
+          continue;
+        }
+
+        foreach ( QString column, filter->tree()->referencedColumns() )
+          job.ruleFields << vlayer->fieldNameIndex( column );
+      }
+
+      QString styleBody = styleKmlSymbolV2( rule.symbol() );
+      QString ruleStyleId = removeEscapeChars( styleId + STYLEIDDELIMIT + QString::number( i ) );
+      job.ruleFilters << filter;
+      job.ruleStyleIds << registerStyle( ruleStyleId, styleBody, styleTable, out );
+    }
+  }
+}
+
+// style of the feature's class, empty if the feature is not in any class
+QString QgsKmlConverter::classStyleId( const LayerJob &job, const QgsAttributeMap &attrMap ) const
+{
+  switch ( job.classification )
+  {
+  case UniqueValues:
+    return job.classStyleIds.value( attrMap.value( job.classificationField ).toString() );
+
+  case ValueRanges:
+    {
+      QVariant value = attrMap.value( job.classificationField );
+      if ( value.isNull() )
+        return QString();
+
+      // first range ending at or above value
+      double number = value.toDouble();
+      QVector<double>::const_iterator it = qLowerBound( job.rangeUpperValues.constBegin(),
+                                                        job.rangeUpperValues.constEnd(), number );
+      if ( it == job.rangeUpperValues.constEnd() )
+        return QString();
+
+      int i = it - job.rangeUpperValues.constBegin();
+      return number >= job.rangeLowerValues.at( i ) ? job.rangeStyleIds.at( i ) : QString();
+    }
+
+  case Rules:
+    for ( int i = 0; i < job.ruleFilters.count(); i++ )
+    {
+      QgsSearchTreeNode *tree = job.ruleFilters.at( i )->tree();
+      if ( !tree || tree->checkAgainst( job.fields, attrMap ) )
+        return job.ruleStyleIds.at( i );
+    }
+    return QString();
+
+  case SingleStyle:
+    break;
+  }
+
+  return job.styleId;
+}
+
+// filters keep the error of the last evaluation, so jobs encoded at the same time
+// must not share them. Filters which parsed once parse again.
+void QgsKmlConverter::copyRuleFilters( LayerJob &job ) const
+{
+  QList< QSharedPointer<QgsSearchString> > filters;
+  foreach ( QSharedPointer<QgsSearchString> filter, job.ruleFilters )
+  {
+    QSharedPointer<QgsSearchString> copy( new QgsSearchString );
+    if ( filter->tree() )
+      copy->setString( filter->string() );
+    filters << copy;
+  }
+  job.ruleFilters = filters;
+}
+
+// encode features to placemarks, runs in worker threads so must not touch the layer
+QString QgsKmlConverter::placemarksKml( const LayerJob &job ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  if ( job.inFolder )
+  {
+    out << "<Folder>" << endl
+        << "<name>" << removeEscapeChars( job.name ) << "</name>" << endl;
+  }
+
+  // clusters are shown while zoomed out, features themselves appear when zooming in
+  if ( job.clusterLevels > 0 )
+  {
+    out << clustersKml( job );
+    out << "<Folder>" << endl
+        << "<name>" << tr( "Features" ) << "</name>" << endl
+        << regionKml( job.extent, clusterLodPixels( job.clusterLevels ), -1 ) << endl;
+  }
+
+  // identity of features is kept only when their names or descriptions are written
+  bool merge = job.mergeBatchSize > 0 && canMergeFeatures( job );
+  QMap<QString, QStringList> batches;
+
+  // export eatch feature to kml format
+  for ( int i = 0; i < job.features.count(); i++ )
+  {
+    const QgsFeature &feature = job.features.at( i );
+    if ( !feature.geometry() && !job.geometryKml.contains( feature.id() ) )
+      continue;
+
+    // encoded ahead while the user was aiming
+    QHash<int, QString>::const_iterator cached = job.placemarkCache.constFind( feature.id() );
+    if ( cached != job.placemarkCache.constEnd() )
+    {
+      out << cached.value();
+      continue;
+    }
+
+    QString styleId = job.presetStyle ? job.styleId : classStyleId( job, feature.attributeMap() );
+
+    if ( merge )
+    {
+      QStringList &batch = batches[styleId];
+      batch << geometryKml( job, feature );
+      if ( batch.count() >= job.mergeBatchSize )
+      {
+        out << mergedPlacemarkKml( job, styleId, batch );
+        batch.clear();
+      }
+      continue;
+    }
+
+    out << placemarkKml( job, feature, styleId );
+  }
+
+  // rest of the batches
+  QMap<QString, QStringList>::const_iterator batchIt = batches.constBegin();
+  for ( ; batchIt != batches.constEnd(); ++batchIt )
+  {
+    if ( !batchIt.value().isEmpty() )
+      out << mergedPlacemarkKml( job, batchIt.key(), batchIt.value() );
+  }
+
+  if ( job.clusterLevels > 0 )
+    out << "</Folder>" << endl;
+
+  if ( job.inFolder )
+    out << "</Folder>" << endl;
+
+  if ( mCompact )
+  {
+    out.flush();
+    return compactKml( result );
+  }
+  return result;
+}
+
+// placemark of one feature with its name, description, style and data
+QString QgsKmlConverter::placemarkKml( const LayerJob &job, const QgsFeature &feature, const QString &styleId ) const
+{
+  QString result;
+  QTextStream out( &result );
+  const QgsAttributeMap &attrMap = feature.attributeMap();
+
+  // id stays the same while the feature exists, so updates can refer to it
+  out << "<Placemark id=\"" << job.idPrefix << feature.id() << "\">" << endl;
+  if ( job.classification == UniqueValues )
+  {
+    // Unique Value, feature is named by its class
+    QString className = attrMap.value( job.classificationField ).toString();
+    if ( !styleId.isEmpty() && job.nameTemplate.isEmpty() )
+      out << "<name>" << removeEscapeChars( className ) << "</name>" << endl;
+  }
+  else
+  {
+    // try to find name of feature from attribute table and set one for kml's placemark as html
+    out << placemarkNameKml( job.nameIndex, attrMap ) << endl;
+  }
+
+  if ( !job.nameTemplate.isEmpty() )
+    out << "<name>" << Qt::escape( expandTemplate( job.nameTemplate, attrMap ) ) << "</name>" << endl;
+
+  // try to find placemark description in attribute table (it should be in html format)
+  out << placemarkDescriptionKml( job.descriptionIndex, attrMap ) << endl;
+
+  // ]]> in values would end the CDATA section, it is split to two sections
+  if ( !job.descriptionTemplate.isEmpty() )
+    out << "<description><![CDATA[" << expandTemplate( job.descriptionTemplate, attrMap ).replace( "]]>", "]]]]><![CDATA[>" )
+        << "]]></description>" << endl;
+
+  if ( !styleId.isEmpty() )
+    out << "<styleUrl>" << job.styleUrlBase << "#" << styleId << "</styleUrl>" << endl;
+
+  if ( !job.extendedDataFields.isEmpty() )
+  {
+    out << "<ExtendedData><SchemaData schemaUrl=\"#" << job.schemaId << "\">" << endl;
+    for ( int j = 0; j < job.extendedDataFields.count(); j++ )
+    {
+      QVariant value = attrMap.value( job.extendedDataFields.at( j ) );
+      if ( value.isNull() )
+        continue;
+      out << "<SimpleData name=\"" << job.extendedDataNames.at( j ) << "\">"
+          << Qt::escape( value.toString() ) << "</SimpleData>" << endl;
+    }
+    out << "</SchemaData></ExtendedData>" << endl;
+  }
+
+  // convert wkt to kml and write to kml file
+  out << geometryKml( job, feature ) << endl;
+  out << "</Placemark>" << endl;
+
+  return result;
+}
+
+QString QgsKmlConverter::geometryKml( const LayerJob &job, const QgsFeature &feature ) const
+{
+  QHash<int, QString>::const_iterator written = job.geometryKml.constFind( feature.id() );
+  if ( written != job.geometryKml.constEnd() )
+    return databaseGeometryKml( written.value() );
+
+  return convertWkbToKml( feature.geometry(), job.decimals );
+}
+
+// database writes bare geometries, flags of the geometry types are added as the encoders write them
+QString QgsKmlConverter::databaseGeometryKml( const QString &kml ) const
+{
+  QString point = "<Point>\n";
+  if ( !mCompact || mPointOptions.extrude != 0 )
+    point += QString( "<extrude>%1</extrude>\n" ).arg( mPointOptions.extrude );
+  if ( !mCompact || mPointOptions.altitudeMode != "clampToGround" )
+    point += "<altitudeMode>" + mPointOptions.altitudeMode + "</altitudeMode>\n";
+
+  QString line = "<LineString>\n";
+  if ( !mCompact || mLineOptions.extrude != 0 )
+    line += QString( "<extrude>%1</extrude>\n" ).arg( mLineOptions.extrude );
+  if ( !mCompact || mLineOptions.tessellate != 0 )
+    line += QString( "<tessellate>%1</tessellate>\n" ).arg( mLineOptions.tessellate );
+  if ( !mCompact || mLineOptions.altitudeMode != "clampToGround" )
+    line += "<altitudeMode>" + mLineOptions.altitudeMode + "</altitudeMode>\n";
+
+  QString polygon = "<Polygon>\n";
+  if ( !mCompact || mPolyOptions.extrude != 0 )
+    polygon += QString( "<extrude>%1</extrude>\n" ).arg( mPolyOptions.extrude );
+  if ( !mCompact || mPolyOptions.tessellate != 0 )
+    polygon += QString( "<tessellate>%1</tessellate>\n" ).arg( mPolyOptions.tessellate );
+  if ( !mCompact || mPolyOptions.altitudeMode != "clampToGround" )
+    polygon += "<gx:altitudeMode>" + mPolyOptions.altitudeMode + "</gx:altitudeMode>\n";
+
+  QString result = kml;
+  result.replace( "<Point>", point );
+  result.replace( "<LineString>", line );
+  result.replace( "<Polygon>", polygon );
+  return result;
+}
+
+// placemark of each feature of the job, empty for features without geometry
+QStringList QgsKmlConverter::featurePlacemarks( const LayerJob &job ) const
+{
+  QStringList placemarks;
+  foreach ( const QgsFeature &feature, job.features )
+  {
+    QString placemark;
+    if ( feature.geometry() )
+      placemark = placemarkKml( job, feature, classStyleId( job, feature.attributeMap() ) );
+    placemarks << ( mCompact ? compactKml( placemark ) : placemark );
+  }
+  return placemarks;
+}
+
+// features without names, descriptions and extended data may share placemarks
+bool QgsKmlConverter::canMergeFeatures( const LayerJob &job ) const
+{
+  return job.nameIndex == -1 && job.descriptionIndex == -1
+         && job.nameTemplate.isEmpty() && job.descriptionTemplate.isEmpty()
+         && job.extendedDataFields.isEmpty();
+}
+
+// one placemark for geometries of many features with the same style
+QString QgsKmlConverter::mergedPlacemarkKml( const LayerJob &job, const QString &styleId,
+                                             const QStringList &geometries ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  out << "<Placemark>" << endl;
+  if ( !styleId.isEmpty() )
+    out << "<styleUrl>" << job.styleUrlBase << "#" << styleId << "</styleUrl>" << endl;
+  out << "<MultiGeometry>" << endl;
+  foreach ( const QString &geometry, geometries )
+    out << geometry << endl;
+  out << "</MultiGeometry>" << endl
+      << "</Placemark>" << endl;
+
+  return result;
+}
+
+// cluster points of the layer for each zoom level, levels are built in parallel
+QString QgsKmlConverter::clustersKml( const LayerJob &job ) const
+{
+  QList<QgsPoint> points;
+  for ( int i = 0; i < job.features.count(); i++ )
   {
-    // create style kml for many symbols
-    out << styleKmlUniqueValue( vlayer->getTransparency(), styleId, symbols ) << endl;
+    QgsGeometry *geometry = job.features.at( i ).geometry();
+    if ( !geometry )
+      continue;
+
+    if ( geometry->isMultipart() )
+      points << geometry->asMultiPoint().toList();
+    else
+      points << geometry->asPoint();
   }
-  else
+
+  QList< QFuture<QString> > levels;
+  for ( int level = 0; level < job.clusterLevels; level++ )
+    levels << QtConcurrent::run( this, &QgsKmlConverter::clusterLevelKml, job, points, level );
+
+  QString result;
+  foreach ( QFuture<QString> level, levels )
+    result += level.result();
+
+  return result;
+}
+
+// gather points to cells of a regular grid in one pass, the grid gets twice finer with each level
+QString QgsKmlConverter::clusterLevelKml( const LayerJob &job, const QList<QgsPoint> &points, int level ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  double cellSize = qMax( job.extent.width(), job.extent.height() ) / ( 16 << level );
+  if ( cellSize <= 0 )
+    cellSize = 1.0;
+
+  QHash< QPair<int, int>, int > cellIndex;
+  QVector<PointCluster> clusters;
+  foreach ( const QgsPoint &pt, points )
   {
-    // dont process other renderers symbols
+    QPair<int, int> cell( int(( pt.x() - job.extent.xMinimum() ) / cellSize ),
+                          int(( pt.y() - job.extent.yMinimum() ) / cellSize ) );
+    int index = cellIndex.value( cell, -1 );
+    if ( index == -1 )
+    {
+      PointCluster cluster = { 0, 0.0, 0.0 };
+      index = clusters.count();
+      cellIndex.insert( cell, index );
+      clusters.append( cluster );
+    }
+    PointCluster &cluster = clusters[index];
+    cluster.count++;
+    cluster.sumX += pt.x();
+    cluster.sumY += pt.y();
   }
 
-  // export eatch feature to kml format
-  foreach ( QgsFeature feature, flist )
+  out << "<Folder>" << endl
+      << "<name>" << tr( "Clusters, level %1" ).arg( level + 1 ) << "</name>" << endl
+      << regionKml( job.extent, level == 0 ? 0 : clusterLodPixels( level ), clusterLodPixels( level + 1 ) ) << endl;
+
+  foreach ( const PointCluster &cluster, clusters )
   {
-    QgsGeometry *geometry = feature.geometry();
-    if ( geometry )
-    {
-      out << "<Placemark>" << endl;
-      // try to find name of feature from attribute table and set one for kml's placemark as html
-      if ( bSingleSymbol )
-      {
-        out << placemarkNameKml( vlayer, feature.attributeMap() ) << endl;
-      }
-      else // Unique Value
-      {
-        const QgsUniqueValueRenderer *urenderer = dynamic_cast<const QgsUniqueValueRenderer *>( renderer );
-        QgsSymbol *symbol = symbolForFeature( &feature, urenderer );
-        if ( symbol )
-          out << "<name>" + removeEscapeChars( symbol->lowerValue() ) + "</name>" << endl;
-      }
+    // bigger clusters get bigger icons, one size class per order of magnitude
+    int sizeClass = 0;
+    for ( int n = cluster.count; n >= 10 && sizeClass < job.clusterStyleIds.count() - 1; n /= 10 )
+      sizeClass++;
+
+    QgsGeometry *geometry = QgsGeometry::fromPoint( QgsPoint( cluster.sumX / cluster.count,
+                                                              cluster.sumY / cluster.count ) );
+    out << "<Placemark>" << endl
+        << "<name>" << cluster.count << "</name>" << endl
+        << "<styleUrl>" << job.styleUrlBase << "#" << job.clusterStyleIds.at( sizeClass ) << "</styleUrl>" << endl
+        << convertWkbToKml( geometry, job.decimals ) << endl
+        << "</Placemark>" << endl;
+    delete geometry;
+  }
 
-      // try to find placemark description in attribute table (it should be in html format)
-      out << placemarkDescriptionKml( vlayer, feature.attributeMap() ) << endl;
+  out << "</Folder>" << endl;
+  return result;
+}
 
-      if ( bUniqueValue )
-      {
-        const QgsUniqueValueRenderer *uniqValRenderer = dynamic_cast<const QgsUniqueValueRenderer *>( renderer );
-        QgsSymbol *symbol = symbolForFeature( &feature, uniqValRenderer );
-        QString uniqStyleId = featureStyleId( symbol, styleId );
-        out << "<styleUrl>" << uniqStyleId << "</styleUrl>" << endl;
-      }
-      else
-      {
-        out << "<styleUrl>" << styleId << "</styleUrl>" << endl;
-      }
+// size on screen in pixels of the layer extent where cluster level begins
+int QgsKmlConverter::clusterLodPixels( int level ) const
+{
+  return 256 << level;
+}
 
-      // convert wkt to kml and write to kml file
-      out << convertWkbToKml(geometry) << endl;
-      out << "</Placemark>" << endl;
-    }
-  }
+// region of the extent, shown when its size on screen is between minLodPixels and maxLodPixels
+QString QgsKmlConverter::regionKml( const QgsRectangle &rect, int minLodPixels, int maxLodPixels ) const
+{
+  QString result;
+  QTextStream out( &result );
 
-  out << "</Document>" << endl
-      << "</kml>" << endl;
+  out << "<Region>" << endl
+      << "<LatLonAltBox>" << endl
+      << "<north>" << QString::number( rect.yMaximum(), 'f', 6 ) << "</north>" << endl
+      << "<south>" << QString::number( rect.yMinimum(), 'f', 6 ) << "</south>" << endl
+      << "<east>" << QString::number( rect.xMaximum(), 'f', 6 ) << "</east>" << endl
+      << "<west>" << QString::number( rect.xMinimum(), 'f', 6 ) << "</west>" << endl
+      << "</LatLonAltBox>" << endl
+      << "<Lod>" << endl
+      << "<minLodPixels>" << minLodPixels << "</minLodPixels>" << endl
+      << "<maxLodPixels>" << maxLodPixels << "</maxLodPixels>" << endl
+      << "</Lod>" << endl
+      << "</Region>";
 
-  QgsApplication::restoreOverrideCursor();
-  return tempFile->fileName();
+  return result;
 }
 
 // try to find feature's name in attribute table
@@ -171,13 +2438,11 @@ int QgsKmlConverter::attributeNameIndex( QgsVectorLayer *vlayer )
 }
 
 // create kml string with feature's name from attribute table
-QString QgsKmlConverter::placemarkNameKml( QgsVectorLayer *vlayer, QgsAttributeMap attrMap )
+QString QgsKmlConverter::placemarkNameKml( int index, const QgsAttributeMap &attrMap ) const
 {
   QString result;
   QTextStream out( &result );
 
-  int index = attributeNameIndex( vlayer );
-
   if ( index > -1 )
   {
     QString name = attrMap.value( index ).toString();
@@ -206,13 +2471,11 @@ int QgsKmlConverter::attributeDescriprionIndex( QgsVectorLayer *vlayer )
 }
 
 // create kml string with feature's description from attribute table
-QString QgsKmlConverter::placemarkDescriptionKml( QgsVectorLayer *vlayer, QgsAttributeMap attrMap )
+QString QgsKmlConverter::placemarkDescriptionKml( int index, const QgsAttributeMap &attrMap ) const
 {
   QString result;
   QTextStream out( &result );
 
-  int index = attributeDescriprionIndex( vlayer );
-
   if ( index > -1 )
   {
     QString description = attrMap.value( index ).toString();
@@ -235,22 +2498,6 @@ QRgb QgsKmlConverter::rgba2abgr( QColor color )
   return color.rgba();
 }
 
-// find symbol (that contains color, size, fill settings) wich feature will be draw
-QgsSymbol *QgsKmlConverter::symbolForFeature( QgsFeature *feature, const QgsUniqueValueRenderer *urenderer )
-{
-  //first find out the value
-  const QgsAttributeMap& attrs = feature->attributeMap();
-  QString value = attrs[ urenderer->classificationField() ].toString();
-
-  QList<QgsSymbol *> symbols = urenderer->symbols();
-  foreach( QgsSymbol *symbol, symbols )
-  {
-    if ( symbol->lowerValue() == value )
-      return symbol;
-  }
-  return NULL;
-}
-
 // create kml style identificator for feature
 QString QgsKmlConverter::featureStyleId( QgsSymbol *symbol, QString styleId )
 {
@@ -260,17 +2507,59 @@ QString QgsKmlConverter::featureStyleId( QgsSymbol *symbol, QString styleId )
     return "";
 }
 
-// create string with kml style description section, all values takes from settings
-QString QgsKmlConverter::styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QString styleId, QGis::GeometryType typeOfFeature )
+// add style to the style table if there is no equal one yet and return id of the style
+QString QgsKmlConverter::registerStyle( const QString &styleId, const QString &styleBody,
+                                        QMap<QString, QString> &styleTable, QTextStream &out )
 {
-  double scale = 1.0;
-  QSettings settings;
-  QString result, colorMode("normal");
+  if ( styleTable.contains( styleBody ) )
+    return styleTable.value( styleBody );
+
+  // different layers may have the same name
+  QList<QString> usedIds = styleTable.values();
+  QString uniqId = styleId;
+  for ( int i = 1; usedIds.contains( uniqId ); i++ )
+    uniqId = styleId + "-" + QString::number( i );
+
+  styleTable.insert( styleBody, uniqId );
+  out << "<Style id=\"" << uniqId << "\">" << endl
+      << styleBody
+      << "</Style>" << endl;
+
+  return uniqId;
+}
+
+// style of cluster placemarks, icon grows with size class of the cluster
+QString QgsKmlConverter::clusterStyleKml( int sizeClass )
+{
+  QString result;
   QTextStream out( &result );
-  QColor color, fillColor;
-  bool bOverrideLayerStyle = settings.value("/qgis2google/overridelayerstyle").toBool();
 
-  out << "<Style id=\"" << styleId << "\">" << endl;
+  QString iconHref = myPathToIcon;
+  if ( mEmbedIcons )
+  {
+    QImage image( ICONSIZE, ICONSIZE, QImage::Format_ARGB32 );
+    image.fill( 0 );
+    QPainter painter( &image );
+    painter.setRenderHint( QPainter::Antialiasing );
+    painter.setPen( Qt::NoPen );
+    painter.setBrush( Qt::white );
+    painter.drawEllipse( image.rect().adjusted( 4, 4, -4, -4 ) );
+    painter.end();
+    iconHref = registerIcon( image );
+  }
+
+  out << "<IconStyle>" << endl
+      << scaleKml( 1.0 + 0.5 * sizeClass )
+      << "<Icon>" << endl << "<href>" << iconHref << "</href>" << endl << "</Icon>" << endl
+      << "</IconStyle>" << endl;
+
+  return result;
+}
+
+// create string with kml style description section, values takes from symbol or from settings
+QString QgsKmlConverter::styleKmlSymbol( int transp, QgsSymbol *symbol, bool overrideLayerStyle )
+{
+  QColor color, fillColor;
 
   color = symbol->color();
   color.setAlpha( transp );
@@ -282,7 +2571,110 @@ QString QgsKmlConverter::styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QS
   bPolyStyle = symbol->pen().style() != Qt::NoPen;
   int outline = bPolyStyle;
 
-  if (bOverrideLayerStyle)
+  // point symbol is shown as it looks in QGIS
+  QString iconHref;
+  if ( mEmbedIcons && !overrideLayerStyle && symbol->type() == QGis::Point )
+    iconHref = registerIcon( symbol->getPointSymbolAsImage() );
+
+  return styleKml( color, fillColor, lineWidth, fill, outline, overrideLayerStyle, iconHref );
+}
+
+// symbols of renderer-v2 have one color, line width is known for line symbols only
+QString QgsKmlConverter::styleKmlSymbolV2( QgsSymbolV2 *symbol )
+{
+  QColor color = symbol->color();
+  color.setAlphaF( symbol->alpha() );
+
+  double lineWidth = 1.0;
+  QgsLineSymbolV2 *lineSymbol = dynamic_cast<QgsLineSymbolV2 *>( symbol );
+  if ( lineSymbol )
+    lineWidth = lineSymbol->width();
+
+  QString iconHref;
+  if ( mEmbedIcons && dynamic_cast<QgsMarkerSymbolV2 *>( symbol ) )
+  {
+    QImage image( ICONSIZE, ICONSIZE, QImage::Format_ARGB32 );
+    image.fill( 0 );
+    QPainter painter( &image );
+    symbol->drawPreviewIcon( &painter, image.size() );
+    painter.end();
+    iconHref = registerIcon( image );
+  }
+
+  return styleKml( color, color, lineWidth, 1, 1, false, iconHref );
+}
+
+// icon is written to kmz later, equal images share one file
+QString QgsKmlConverter::registerIcon( const QImage &image )
+{
+  if ( image.isNull() )
+    return QString();
+
+  QByteArray bits( reinterpret_cast<const char *>( image.bits() ), image.numBytes() );
+  QString href = "icons/" + QCryptographicHash::hash( bits, QCryptographicHash::Md5 ).toHex() + ".png";
+  mIcons.insert( href, image );
+  return href;
+}
+
+QByteArray QgsKmlConverter::iconPng( const QImage &image ) const
+{
+  QByteArray png;
+  QBuffer buffer( &png );
+  buffer.open( QIODevice::WriteOnly );
+  image.save( &buffer, "PNG" );
+  return png;
+}
+
+// put kml and icons it refers to into kmz next to the kml, kml is returned when packing
+// fails or the archive would be too big for zip without zip64
+QString QgsKmlConverter::packKmz( const QString &kmlFileName )
+{
+  QFile kmlFile( kmlFileName );
+  if ( !kmlFile.open( QIODevice::ReadOnly ) )
+    return kmlFileName;
+
+  // icons are encoded to png in parallel
+  QStringList iconHrefs = mIcons.keys();
+  QList< QFuture<QByteArray> > pngs;
+  foreach ( const QImage &image, mIcons )
+    pngs << QtConcurrent::run( this, &QgsKmlConverter::iconPng, image );
+
+  QString kmzFileName = kmlFileName;
+  kmzFileName.replace( QRegExp( "\\.kml$" ), ".kmz" );
+  QgsKmzWriter kmz( kmzFileName );
+  if ( !kmz.open() )
+  {
+    foreach ( QFuture<QByteArray> png, pngs )
+      png.waitForFinished();
+    return kmlFileName;
+  }
+
+  // kml is streamed in chunks, png is compressed already
+  bool ok = kmz.addFile( "doc.kml", &kmlFile );
+  kmlFile.close();
+  for ( int i = 0; i < pngs.count(); i++ )
+    ok = kmz.addFile( iconHrefs.at( i ), pngs[i].result(), false ) && ok;
+  ok = kmz.close() && ok;
+
+  if ( !ok )
+  {
+    QFile::remove( kmzFileName );
+    return kmlFileName;
+  }
+
+  mKmzFiles << kmzFileName;
+  return kmzFileName;
+}
+
+QString QgsKmlConverter::styleKml( QColor color, QColor fillColor, double lineWidth,
+                                   int fill, int outline, bool overrideLayerStyle, const QString &iconHref )
+{
+  double scale = 1.0;
+  QSettings settings;
+  QString result, colorMode("normal");
+  QTextStream out( &result );
+
+  if (overrideLayerStyle)
   {
     color = settings.value( "/qgis2google/label/color" ).value<QColor>();
     colorMode = settings.value( "/qgis2google/label/colormode" ).toString();
@@ -290,24 +2682,24 @@ QString QgsKmlConverter::styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QS
   }
   out << "<LabelStyle>" << endl
       << "<color>" << hex << rgba2abgr( color ) << dec << "</color>" << endl
-      << "<colorMode>" << colorMode << "</colorMode>" << endl
-      << "<scale>" << scale << "</scale>" << endl
+      << colorModeKml( colorMode ) << scaleKml( scale )
       << "</LabelStyle>" << endl;
 
-  if (bOverrideLayerStyle)
+  if (overrideLayerStyle)
   {
     fillColor = settings.value( "/qgis2google/icon/color" ).value<QColor>();
     colorMode = settings.value( "/qgis2google/icon/colormode" ).toString();
     scale = settings.value( "/qgis2google/icon/scale" ).toDouble();
   }
+  // rendered icon has its own colors
+  QColor iconColor = iconHref.isEmpty() ? fillColor : QColor( Qt::white );
   out << "<IconStyle>" << endl
-      << "<color>" << hex << rgba2abgr( fillColor ) << dec << "</color>" << endl
-      << "<colorMode>" << colorMode << "</colorMode>" << endl
-      << "<scale>" << scale << "</scale>" << endl
-      << "<Icon>" << endl << "<href>" << myPathToIcon << "</href>" << endl << "</Icon>" << endl
+      << "<color>" << hex << rgba2abgr( iconColor ) << dec << "</color>" << endl
+      << colorModeKml( colorMode ) << scaleKml( scale )
+      << "<Icon>" << endl << "<href>" << ( iconHref.isEmpty() ? myPathToIcon : iconHref ) << "</href>" << endl << "</Icon>" << endl
       << "</IconStyle>" << endl;
 
-  if (bOverrideLayerStyle)
+  if (overrideLayerStyle)
   {
     color = settings.value( "/qgis2google/line/color" ).value<QColor>();
     colorMode = settings.value( "/qgis2google/line/colormode" ).toString();
@@ -315,11 +2707,12 @@ QString QgsKmlConverter::styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QS
   }
   out << "<LineStyle>" << endl
       << "<color>" << hex << rgba2abgr( color ) << dec << "</color>" << endl
-      << "<colorMode>" << colorMode << "</colorMode>" << endl
-      << "<width>" << lineWidth << "</width>" << endl
-      << "</LineStyle>" << endl;
+      << colorModeKml( colorMode );
+  if ( !mCompact || lineWidth != 1.0 )
+    out << "<width>" << lineWidth << "</width>" << endl;
+  out << "</LineStyle>" << endl;
 
-  if (bOverrideLayerStyle)
+  if (overrideLayerStyle)
   {
     fillColor = settings.value( "/qgis2google/poly/color" ).value<QColor>();
     colorMode = settings.value( "/qgis2google/poly/colormode" ).toString();
@@ -328,75 +2721,34 @@ QString QgsKmlConverter::styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QS
   }
   out << "<PolyStyle>" << endl
       << "<color>" << hex << rgba2abgr( fillColor ) << dec << "</color>" << endl
-      << "<colorMode>" << colorMode << "</colorMode>" << endl
-      << "<fill>" << fill << "</fill>" << endl
-      << "<outline>" << outline << "</outline>" << endl
-      << "</PolyStyle>" << endl;
-
-  out << "</Style>";
+      << colorModeKml( colorMode );
+  if ( !mCompact || fill != 1 )
+    out << "<fill>" << fill << "</fill>" << endl;
+  if ( !mCompact || outline != 1 )
+    out << "<outline>" << outline << "</outline>" << endl;
+  out << "</PolyStyle>" << endl;
 
   return result;
 }
 
-// create string with kml style description section for each symbols, all values takes from settings
-QString QgsKmlConverter::styleKmlUniqueValue( int transp, QString styleId, QList<QgsSymbol *> symbols )
+QString QgsKmlConverter::colorModeKml( const QString &colorMode ) const
 {
-  double scale = 1.0;
-  QString result, colorMode( "normal" );
-  QTextStream out( &result );
-  QColor color, fillColor;
+  if ( mCompact && colorMode == "normal" )
+    return QString();
+  return "<colorMode>" + colorMode + "</colorMode>\n";
+}
 
-  foreach( QgsSymbol *symbol, symbols )
-  {
-    out << endl << "<Style id=\"" << featureStyleId( symbol, styleId ) << "\">" << endl;
-
-    color = symbol->color();
-    color.setAlpha( transp );
-    fillColor = symbol->fillColor();
-    fillColor.setAlpha( transp );
-
-    out << "<LabelStyle>" << endl
-        << "<color>" << hex << rgba2abgr( color ) << dec << "</color>" << endl
-        << "<colorMode>" << colorMode << "</colorMode>" << endl
-        << "<scale>" << scale << "</scale>" << endl
-        << "</LabelStyle>" << endl;
-
-    out << "<IconStyle>" << endl
-        << "<color>" << hex << rgba2abgr( fillColor ) << dec << "</color>" << endl
-        << "<colorMode>" << colorMode << "</colorMode>" << endl
-        << "<scale>" << scale << "</scale>" << endl
-        << "<Icon>" << endl << "<href>" << myPathToIcon << "</href>" << endl << "</Icon>" << endl
-        << "</IconStyle>" << endl;
-
-    double lineWidth = symbol->lineWidth();
-    out << "<LineStyle>" << endl
-        << "<color>" << hex << rgba2abgr( color ) << dec << "</color>" << endl
-        << "<colorMode>" << colorMode << "</colorMode>" << endl
-        << "<width>" << lineWidth << "</width>" << endl
-        << "</LineStyle>" << endl;
-
-    int bPolyStyle = symbol->brush().style() != Qt::NoBrush;
-    int fill = bPolyStyle;
-    bPolyStyle = symbol->pen().style() != Qt::NoPen;
-    int outline = bPolyStyle;
-    out << "<PolyStyle>" << endl
-        << "<color>" << hex << rgba2abgr( fillColor ) << dec << "</color>" << endl
-        << "<colorMode>" << colorMode << "</colorMode>" << endl
-        << "<fill>" << fill << "</fill>" << endl
-        << "<outline>" << outline << "</outline>" << endl
-        << "</PolyStyle>" << endl;
-
-    out << "</Style>";
-  }
-  return result;
+QString QgsKmlConverter::scaleKml( double scale ) const
+{
+  if ( mCompact && scale == 1.0 )
+    return QString();
+  return "<scale>" + QString::number( scale ) + "</scale>\n";
 }
 
-QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry )
+QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry, int decimals ) const
 {
   QString result;
-  QSettings settings;
   QTextStream out( &result );
-  bool hasZValue;
 
   QGis::WkbType wkbType = geometry->wkbType();
   switch (wkbType)
@@ -404,124 +2756,30 @@ QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry )
   case QGis::WKBPoint25D:
   case QGis::WKBPoint:
     {
-      int altitudeVal = settings.value( "/qgis2google/point/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/point/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor";
-
-      QgsPoint wkbPoint = geometry->asPoint();
-      QString pointString = QString::number(wkbPoint.x(), 'f', 6) + "," +
-                            QString::number(wkbPoint.y(), 'f', 6);
-      if ( hasZValue )
-        pointString.append(QString(",%1").arg(altitudeVal));
-
-      int extrude = settings.value( "/qgis2google/point/extrude" ).toInt();
-      out << "<Point>" << endl
-          << "<extrude>" << extrude << "</extrude>" << endl
-          << "<altitudeMode>" << altitudeMode << "</altitudeMode>" << endl
-          << "<coordinates>" << pointString << "</coordinates>" << endl
-          << "</Point>";
-
+      // single point takes the altitude even when it is -1
+      bool hasZValue = mPointOptions.altitudeMode != "clampToGround" && mPointOptions.altitudeMode != "clampToSeaFloor";
+      out << pointKml( geometry->asPoint(), hasZValue, decimals );
       return result;
     }
   case QGis::WKBLineString25D:
   case QGis::WKBLineString:
     {
-      int altitudeVal = settings.value( "/qgis2google/line/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/line/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor" && altitudeVal != -1;
-
-      QgsPolyline wkbPolyline = geometry->asPolyline();
-      QString polylineString;
-      foreach (QgsPoint pt, wkbPolyline)
-      {
-        polylineString += QString::number(pt.x(), 'f', 6) + "," +
-                          QString::number(pt.y(), 'f', 6);
-        if (hasZValue)
-          polylineString += QString(",%1").arg(altitudeVal);
-
-        polylineString += " ";
-      }
-      polylineString.chop(1);
-
-      int extrude = settings.value( "/qgis2google/line/extrude" ).toInt();
-      int tessellate = settings.value( "/qgis2google/line/tessellate" ).toInt();
-      out << "<LineString>" << endl
-          << "<extrude>" << extrude << "</extrude>" << endl
-          << "<tessellate>" << tessellate << "</tessellate>" << endl
-          << "<altitudeMode>" << altitudeMode << "</altitudeMode>" << endl
-          << "<coordinates>" << polylineString << "</coordinates>" << endl
-          << "</LineString>";
-
+      out << lineStringKml( geometry->asPolyline(), decimals );
       return result;
     }
   case QGis::WKBPolygon25D:
   case QGis::WKBPolygon:
     {
-      int altitudeVal = settings.value( "/qgis2google/poly/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/poly/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor" && altitudeVal != -1;
-
-      QgsPolygon wkbPolygon = geometry->asPolygon();
-      QStringList polylineStringList;
-      foreach (QgsPolyline ln, wkbPolygon)
-      {
-        QString polylineString;
-        foreach (QgsPoint pt, ln)
-        {
-          polylineString += QString::number(pt.x(), 'f', 6) + "," +
-                            QString::number(pt.y(), 'f', 6);
-          if (hasZValue)
-            polylineString += QString(",%1").arg(altitudeVal);
-
-          polylineString += " ";
-        }
-        polylineString.chop(1);
-        polylineStringList.append(polylineString);
-      }
-
-      int extrude = settings.value( "/qgis2google/poly/extrude" ).toInt();
-      int tessellate = settings.value( "/qgis2google/poly/tessellate" ).toInt();
-      out << "<Polygon>" << endl
-          << "<extrude>" << extrude << "</extrude>" << endl
-          << "<tessellate>" << tessellate << "</tessellate>" << endl
-          << "<gx:altitudeMode>" << altitudeMode << "</gx:altitudeMode>" << endl
-          << "<outerBoundaryIs>" << endl << "<LinearRing>" << endl
-          << "<coordinates>" << polylineStringList.at( 0 ) << "</coordinates>" << endl
-          << "</LinearRing>" << endl << "</outerBoundaryIs>" << endl;
-
-      for( int i = 1; i < polylineStringList.count(); i++ )
-      {
-        out << "<innerBoundaryIs>" << endl << "<LinearRing>" << endl
-            << "<coordinates>" << polylineStringList.at( i ) << "</coordinates>" << endl
-            << "</LinearRing>" << endl << "</innerBoundaryIs>" << endl;
-      }
-      out << "</Polygon>";
-
+      out << polygonKml( geometry->asPolygon(), decimals );
       return result;
     }
   case QGis::WKBMultiPoint25D:
   case QGis::WKBMultiPoint:
     {
-      int altitudeVal = settings.value( "/qgis2google/point/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/point/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor" && altitudeVal != -1;
-
       out << "<MultiGeometry>" << endl;
       QgsMultiPoint wkbMultiPoint = geometry->asMultiPoint();
       foreach (QgsPoint pt, wkbMultiPoint)
-      {
-        QString pointString = QString::number(pt.x(), 'f', 6) + "," +
-                              QString::number(pt.y(), 'f', 6);
-        if ( hasZValue )
-          pointString.append(QString(",%1").arg(altitudeVal));
-
-        int extrude = settings.value( "/qgis2google/point/extrude" ).toInt();
-        out << "<Point>" << endl
-            << "<extrude>" << extrude << "</extrude>" << endl
-            << "<altitudeMode>" << altitudeMode << "</altitudeMode>" << endl
-            << "<coordinates>" << pointString << "</coordinates>" << endl
-            << "</Point>" << endl;
-      }
+        out << pointKml( pt, mPointOptions.hasZValue, decimals ) << endl;
       out << "</MultiGeometry>";
 
       return result;
@@ -529,35 +2787,10 @@ QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry )
   case QGis::WKBMultiLineString25D:
   case QGis::WKBMultiLineString:
     {
-      int altitudeVal = settings.value( "/qgis2google/line/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/line/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor" && altitudeVal != -1;
-
       out << "<MultiGeometry>" << endl;
       QgsMultiPolyline wkbMultiPolyline = geometry->asMultiPolyline();
       foreach (QgsPolyline ln, wkbMultiPolyline)
-      {
-        QString polylineString;
-        foreach (QgsPoint pt, ln)
-        {
-          polylineString += QString::number(pt.x(), 'f', 6) + "," +
-                            QString::number(pt.y(), 'f', 6);
-          if (hasZValue)
-            polylineString += QString(",%1").arg(altitudeVal);
-
-          polylineString += " ";
-        }
-        polylineString.chop(1);
-
-        int extrude = settings.value( "/qgis2google/line/extrude" ).toInt();
-        int tessellate = settings.value( "/qgis2google/line/tessellate" ).toInt();
-        out << "<LineString>" << endl
-            << "<extrude>" << extrude << "</extrude>" << endl
-            << "<tessellate>" << tessellate << "</tessellate>" << endl
-            << "<altitudeMode>" << altitudeMode << "</altitudeMode>" << endl
-            << "<coordinates>" << polylineString << "</coordinates>" << endl
-            << "</LineString>" << endl;
-      }
+        out << lineStringKml( ln, decimals ) << endl;
       out << "</MultiGeometry>";
 
       return result;
@@ -565,49 +2798,10 @@ QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry )
   case QGis::WKBMultiPolygon25D:
   case QGis::WKBMultiPolygon:
     {
-      int altitudeVal = settings.value( "/qgis2google/poly/altitudevalue" ).toInt();
-      QString altitudeMode = settings.value( "/qgis2google/poly/altitudemode" ).toString();
-      hasZValue = altitudeMode != "clampToGround" && altitudeMode != "clampToSeaFloor" && altitudeVal != -1;
-
       out << "<MultiGeometry>" << endl;
       QgsMultiPolygon wkbMultiPolygon = geometry->asMultiPolygon();
       foreach (QgsPolygon pln, wkbMultiPolygon)
-      {
-        QStringList polylineStringList;
-        foreach (QgsPolyline ln, pln)
-        {
-          QString polylineString;
-          foreach (QgsPoint pt, ln)
-          {
-            polylineString += QString::number(pt.x(), 'f', 6) + "," +
-                              QString::number(pt.y(), 'f', 6);
-            if (hasZValue)
-              polylineString += QString(",%1").arg(altitudeVal);
-
-            polylineString += " ";
-          }
-          polylineString.chop(1);
-          polylineStringList.append(polylineString);
-        }
-
-        int extrude = settings.value( "/qgis2google/poly/extrude" ).toInt();
-        int tessellate = settings.value( "/qgis2google/poly/tessellate" ).toInt();
-        out << "<Polygon>" << endl
-            << "<extrude>" << extrude << "</extrude>" << endl
-            << "<tessellate>" << tessellate << "</tessellate>" << endl
-            << "<gx:altitudeMode>" << altitudeMode << "</gx:altitudeMode>" << endl
-            << "<outerBoundaryIs>" << endl << "<LinearRing>" << endl
-            << "<coordinates>" << polylineStringList.at( 0 ) << "</coordinates>" << endl
-            << "</LinearRing>" << endl << "</outerBoundaryIs>" << endl;
-
-        for( int i = 1; i < polylineStringList.count(); i++ )
-        {
-          out << "<innerBoundaryIs>" << endl << "<LinearRing>" << endl
-              << "<coordinates>" << polylineStringList.at( i ) << "</coordinates>" << endl
-              << "</LinearRing>" << endl << "</innerBoundaryIs>" << endl;
-        }
-        out << "</Polygon>" << endl;
-      }
+        out << polygonKml( pln, decimals ) << endl;
       out << "</MultiGeometry>";
 
       return result;
@@ -618,6 +2812,258 @@ QString QgsKmlConverter::convertWkbToKml( QgsGeometry *geometry )
   }
 }
 
+// altitude and flags of points, lines and polygons, read once for the export
+// instead of for each geometry
+void QgsKmlConverter::readGeometryOptions()
+{
+  QSettings settings;
+  mCompact = settings.value( "/qgis2google/compact/enabled" ).toBool();
+
+  QStringList types;
+  types << "point" << "line" << "poly";
+  QList<GeometryOptions *> options;
+  options << &mPointOptions << &mLineOptions << &mPolyOptions;
+  for ( int i = 0; i < types.count(); i++ )
+  {
+    QString key = "/qgis2google/" + types.at( i ) + "/";
+    GeometryOptions *typeOptions = options.at( i );
+    typeOptions->altitude = settings.value( key + "altitudevalue" ).toInt();
+    typeOptions->altitudeMode = settings.value( key + "altitudemode" ).toString();
+    typeOptions->hasZValue = typeOptions->altitudeMode != "clampToGround"
+                             && typeOptions->altitudeMode != "clampToSeaFloor" && typeOptions->altitude != -1;
+    typeOptions->extrude = settings.value( key + "extrude" ).toInt();
+    typeOptions->tessellate = settings.value( key + "tessellate" ).toInt();
+  }
+}
+
+// compact kml leaves out elements equal to their defaults
+QString QgsKmlConverter::pointKml( const QgsPoint &point, bool hasZValue, int decimals ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  out << "<Point>" << endl;
+  if ( !mCompact || mPointOptions.extrude != 0 )
+    out << "<extrude>" << mPointOptions.extrude << "</extrude>" << endl;
+  if ( !mCompact || mPointOptions.altitudeMode != "clampToGround" )
+    out << "<altitudeMode>" << mPointOptions.altitudeMode << "</altitudeMode>" << endl;
+
+  out << "<coordinates>" << coordinateKml( point.x(), decimals ) << "," << coordinateKml( point.y(), decimals );
+  if ( hasZValue && ( !mCompact || mPointOptions.altitude != 0 ) )
+    out << "," << mPointOptions.altitude;
+  out << "</coordinates>" << endl
+      << "</Point>";
+
+  return result;
+}
+
+QString QgsKmlConverter::lineStringKml( const QgsPolyline &line, int decimals ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  out << "<LineString>" << endl;
+  // constant altitude is written once instead of for each vertex
+  if ( mCompact && mLineOptions.hasZValue && mLineOptions.altitude != 0 )
+    out << "<gx:altitudeOffset>" << mLineOptions.altitude << "</gx:altitudeOffset>" << endl;
+  if ( !mCompact || mLineOptions.extrude != 0 )
+    out << "<extrude>" << mLineOptions.extrude << "</extrude>" << endl;
+  if ( !mCompact || mLineOptions.tessellate != 0 )
+    out << "<tessellate>" << mLineOptions.tessellate << "</tessellate>" << endl;
+  if ( !mCompact || mLineOptions.altitudeMode != "clampToGround" )
+    out << "<altitudeMode>" << mLineOptions.altitudeMode << "</altitudeMode>" << endl;
+  out << "<coordinates>" << coordinatesKml( line, mLineOptions, decimals, false ) << "</coordinates>" << endl
+      << "</LineString>";
+
+  return result;
+}
+
+QString QgsKmlConverter::polygonKml( const QgsPolygon &polygon, int decimals ) const
+{
+  QString result;
+  QTextStream out( &result );
+
+  out << "<Polygon>" << endl;
+  if ( !mCompact || mPolyOptions.extrude != 0 )
+    out << "<extrude>" << mPolyOptions.extrude << "</extrude>" << endl;
+  if ( !mCompact || mPolyOptions.tessellate != 0 )
+    out << "<tessellate>" << mPolyOptions.tessellate << "</tessellate>" << endl;
+  if ( !mCompact || mPolyOptions.altitudeMode != "clampToGround" )
+    out << "<gx:altitudeMode>" << mPolyOptions.altitudeMode << "</gx:altitudeMode>" << endl;
+
+  for ( int i = 0; i < polygon.count(); i++ )
+  {
+    QString boundary = i == 0 ? "outerBoundaryIs" : "innerBoundaryIs";
+    out << "<" << boundary << ">" << endl << "<LinearRing>" << endl;
+    if ( mCompact && mPolyOptions.hasZValue && mPolyOptions.altitude != 0 )
+      out << "<gx:altitudeOffset>" << mPolyOptions.altitude << "</gx:altitudeOffset>" << endl;
+    out << "<coordinates>" << coordinatesKml( polygon.at( i ), mPolyOptions, decimals, true ) << "</coordinates>" << endl
+        << "</LinearRing>" << endl << "</" << boundary << ">" << endl;
+  }
+  out << "</Polygon>";
+
+  return result;
+}
+
+// vertices separated by spaces, compact kml has altitude in gx:altitudeOffset
+QString QgsKmlConverter::coordinatesKml( const QgsPolyline &line, const GeometryOptions &options,
+                                         int decimals, bool ring ) const
+{
+  QString altitude;
+  if ( options.hasZValue && !mCompact )
+    altitude = QString( ",%1" ).arg( options.altitude );
+
+  QString result;
+  QgsPolyline vertices = decimals < 0 ? line : quantizeLine( line, decimals, ring );
+  foreach ( const QgsPoint &pt, vertices )
+  {
+    if ( !result.isEmpty() )
+      result += " ";
+    result += coordinateKml( pt.x(), decimals ) + "," + coordinateKml( pt.y(), decimals ) + altitude;
+  }
+  return result;
+}
+
+// snap vertices to the grid of decimals and drop vertices which became equal to
+// the previous one or lie inside a straight run, in one pass over the vertices.
+// The line is kept as it is when too few vertices would be left
+QgsPolyline QgsKmlConverter::quantizeLine( const QgsPolyline &line, int decimals, bool ring ) const
+{
+  double scale = 1.0;
+  for ( int i = 0; i < decimals; i++ )
+    scale *= 10.0;
+
+  // grid coordinates are integers, so straight runs are found exactly
+  QVector<qint64> xs, ys;
+  xs.reserve( line.count() );
+  ys.reserve( line.count() );
+  foreach ( const QgsPoint &pt, line )
+  {
+    qint64 x = qRound64( pt.x() * scale );
+    qint64 y = qRound64( pt.y() * scale );
+    int n = xs.count();
+    if ( n > 0 && xs.at( n - 1 ) == x && ys.at( n - 1 ) == y )
+      continue;
+
+    if ( n > 1 )
+    {
+      // last vertex lies on the segment from the one before it to the new one
+      // longer segments, as of projected coordinates, keep their vertices
+      qint64 dx = x - xs.at( n - 2 ), dy = y - ys.at( n - 2 );
+      qint64 mx = xs.at( n - 1 ) - xs.at( n - 2 ), my = ys.at( n - 1 ) - ys.at( n - 2 );
+      bool small = qAbs( dx ) < QUANTIZEMAXSTEP && qAbs( dy ) < QUANTIZEMAXSTEP
+                   && qAbs( mx ) < QUANTIZEMAXSTEP && qAbs( my ) < QUANTIZEMAXSTEP;
+      qint64 dot = small ? mx * dx + my * dy : 0;
+      if ( small && mx * dy == my * dx && dot > 0 && dot < dx * dx + dy * dy )
+      {
+        xs.remove( n - 1 );
+        ys.remove( n - 1 );
+      }
+    }
+    xs << x;
+    ys << y;
+  }
+
+  // ring needs three corners and the closing vertex, line two vertices
+  if ( xs.count() < ( ring ? 4 : 2 ) )
+    return line;
+
+  QgsPolyline result;
+  result.reserve( xs.count() );
+  for ( int i = 0; i < xs.count(); i++ )
+    result << QgsPoint( xs.at( i ) / scale, ys.at( i ) / scale );
+  return result;
+}
+
+// precision of the source data: the fewest decimals (at most 6) writing a sample
+// of its coordinates exactly
+int QgsKmlConverter::sourceDecimals( const QgsFeatureList &features ) const
+{
+  int decimals = 0;
+  int sampled = 0;
+  for ( int i = 0; i < features.count() && sampled < QUANTIZESAMPLESIZE && decimals < 6; i++ )
+  {
+    QgsGeometry *geometry = features.at( i ).geometry();
+    if ( !geometry )
+      continue;
+
+    int count = qMin( vertexCount( geometry ), QUANTIZESAMPLESIZE - sampled );
+    for ( int j = 0; j < count; j++ )
+    {
+      QgsPoint pt = geometry->vertexAt( j );
+      while ( decimals < 6 && ( !isOnGrid( pt.x(), decimals ) || !isOnGrid( pt.y(), decimals ) ) )
+        decimals++;
+    }
+    sampled += count;
+  }
+  return sampled > 0 ? decimals : 6;
+}
+
+bool QgsKmlConverter::isOnGrid( double value, int decimals ) const
+{
+  for ( int i = 0; i < decimals; i++ )
+    value *= 10.0;
+  return qAbs( value - qRound64( value ) ) < 1e-6;
+}
+
+// 6 decimals unless quantized, compact kml drops trailing zeros so the value is the same
+QString QgsKmlConverter::coordinateKml( double value, int decimals ) const
+{
+  QString text = QString::number( value, 'f', decimals < 0 ? 6 : decimals );
+  if ( !mCompact )
+    return text;
+
+  int length = text.length();
+  if ( text.contains( '.' ) )
+  {
+    while ( text.at( length - 1 ) == '0' )
+      length--;
+    if ( text.at( length - 1 ) == '.' )
+      length--;
+  }
+  text.truncate( length );
+
+  return text == "-0" ? QString( "0" ) : text;
+}
+
+// line breaks between tags mean nothing to kml readers, CDATA sections like
+// a description with <pre> are copied as they are
+QString QgsKmlConverter::compactKml( const QString &kml ) const
+{
+  QString result;
+  result.reserve( kml.length() );
+
+  int length = kml.length();
+  int i = 0;
+  while ( i < length )
+  {
+    if ( kml.at( i ) == '<' && i + 1 < length && kml.at( i + 1 ) == '!' && kml.mid( i, 9 ) == "<![CDATA[" )
+    {
+      int end = kml.indexOf( "]]>", i + 9 );
+      end = end == -1 ? length : end + 3;
+      result += kml.mid( i, end - i );
+      i = end;
+      continue;
+    }
+
+    if ( kml.at( i ) != '\n' || result.isEmpty() || !result.endsWith( '>' ) )
+    {
+      result += kml.at( i++ );
+      continue;
+    }
+
+    int next = i;
+    while ( next < length && kml.at( next ) == '\n' )
+      next++;
+    // text like a description keeps its line breaks
+    if ( next < length && kml.at( next ) != '<' )
+      result += kml.mid( i, next - i );
+    i = next;
+  }
+
+  return result;
+}
+
 // generate name for temporary file
 QString QgsKmlConverter::generateTempFileName()
 {
@@ -654,8 +3100,22 @@ QFile *QgsKmlConverter::getTempFile()
   return NULL;
 }
 
+void QgsKmlConverter::removeTempFile( const QString &fileName )
+{
+  for ( int i = 0; i < mTempKmlFiles.count(); i++ )
+  {
+    if ( mTempKmlFiles.at( i )->fileName() == fileName )
+    {
+      QFile *file = mTempKmlFiles.takeAt( i );
+      file->remove();
+      delete file;
+      return;
+    }
+  }
+}
+
 // remove escape character from kml file string
-QString QgsKmlConverter::removeEscapeChars( QString in )
+QString QgsKmlConverter::removeEscapeChars( QString in ) const
 {
   return in.replace( QRegExp( "&(?!amp;)" ), "&amp;" );
 }
@@ -2,15 +2,31 @@
 #define QGSKMLCONVERTER_H
 
 #include <QColor>
+#include <QFuture>
+#include <QHash>
+#include <QImage>
+#include <QMap>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QStringList>
 #include <QTextStream>
+#include <QVector>
 
 #include <qgis.h>
 #include <qgsfeature.h>
+#include <qgsfield.h>
+#include <qgsgeometry.h>
+#include <qgsrectangle.h>
 
+class QDir;
 class QFile;
 
+class QgsKmlFileWriter;
+class QgsMapRenderer;
 class QgsRenderer;
+class QgsSearchString;
 class QgsSymbol;
+class QgsSymbolV2;
 class QgsVectorLayer;
 class QgsUniqueValueRenderer;
 
@@ -18,35 +34,327 @@ class QgsKmlConverter
 {
   Q_DECLARE_TR_FUNCTIONS(QgsKmlConverter);
 
+  //! piece of name or description template, literal text or a field value
+  struct TemplateFragment
+  {
+    QString text;
+    //! field index, -1 for literal text
+    int field;
+  };
+  typedef QList<TemplateFragment> CompiledTemplate;
+
 public:
   QgsKmlConverter();
   ~QgsKmlConverter();
 
-  QString exportLayerToKmlFile( QgsVectorLayer *vlayer );
+  //! export features of the layer matching filter (sql where clause) found in rect
+  QString exportLayerToKmlFile( QgsVectorLayer *vlayer, const QString &filter = QString(),
+                                const QgsRectangle &rect = QgsRectangle() );
   QString exportFeaturesToKmlFile( QgsVectorLayer *vlayer, const QgsFeatureList &flist );
+  //! export features intersecting rect, simplified to tolerance (in layer units) if it is not 0
+  QString exportFeaturesToKmlFile( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance = 0.0 );
+  //! export several layers to one kml file, each layer goes to its own folder
+  QString exportLayersToKmlFile( const QList<QgsVectorLayer *> &layers );
+  //! export at most one feature per cell of a grid over the layer extent
+  QString exportLayerPreview( QgsVectorLayer *vlayer );
+  //! kml Update replacing changed and removing deleted features of the layer exported before
+  QString exportLayerUpdate( QgsVectorLayer *vlayer, const QString &layerFileName,
+                             const QgsFeatureIds &changedIds, const QgsFeatureIds &deletedIds,
+                             const QString &fileName = QString() );
+  //! kml loading exported layer and refreshing its update periodically
+  QString exportLiveLink( const QString &name, const QString &layerFileName,
+                          const QString &updateFileName, int refreshInterval );
+  //! kml linking the latest update, written to fileName or to a new temporary file when it is empty
+  QString exportUpdateLink( const QString &updateFileName, const QString &fileName = QString() );
+  //! remove a temporary file of this converter before it is destroyed
+  void removeTempFile( const QString &fileName );
+  //! encode features in rect (layer coordinates) for a later send of features with the same
+  //! tolerance, false if canceled before all were encoded
+  bool preEncodeFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance = 0.0 );
+  //! the feature was edited, its placemark encoded ahead is not valid
+  void forgetPlacemark( int fid );
+  void clearPlacemarkCache();
+  //! render layer to png tiles loaded by Google Earth on demand
+  QString exportLayerToSuperOverlay( QgsVectorLayer *vlayer );
+  //! export features of each value of the partition field, or of each unique value class,
+  //! to its own kml linked from the root kml and hidden until switched on
+  QString exportLayerToPartitions( QgsVectorLayer *vlayer );
+
+  //! way of sending a layer, picked by the export estimate
+  enum ExportStrategy
+  {
+    PlainKml = 0,
+    MergedKml,
+    ClusteredKml,
+    RasterTiles
+  };
+
+  //! expected size of the layer export, extrapolated from a sample of features
+  struct ExportEstimate
+  {
+    long featureCount;
+    qint64 vertices;
+    qint64 bytes;
+    int msecs;
+    ExportStrategy strategy;
+  };
+
+  //! estimate export of the whole layer by reading and encoding a few features
+  ExportEstimate estimateLayerExport( QgsVectorLayer *vlayer );
+  static QString strategyDescription( ExportStrategy strategy );
+
+  //! features read and exported, placemarks written and time spent by the last export
+  QString exportStatistics() const;
+
+  //! let the event loop run after each interval features read, 0 never
+  void setYieldInterval( int interval );
+  //! estimated size of the following whole layer exports, 0 when not known
+  void setExpectedBytes( qint64 bytes );
+  //! strategy of the following layer exports on top of the settings, PlainKml leaves them as they are
+  void setStrategy( ExportStrategy strategy );
+  //! styles go to the document even if external styles are set, for kml leaving the temporary directory
+  void setInlineStyles( bool inlineStyles );
+  //! canceled export stops at the next yield
+  void setCanceled( bool canceled );
+  bool isCanceled() const;
+  //! the layer was read by somebody else while events were processed
+  void layerInterrupted( QgsVectorLayer *vlayer );
+
+  //! changes when any export setting changes
+  static QString optionsFingerprint();
 
 private:
+  //! how style of a feature is found
+  enum Classification
+  {
+    SingleStyle = 0,
+    //! by value of classification field
+    UniqueValues,
+    //! by graduated range of classification field
+    ValueRanges,
+    //! by first matching rule
+    Rules
+  };
+
+  //! everything needed to encode features of one layer to placemarks,
+  //! filled in the main thread so the layer is not touched while encoding
+  struct LayerJob
+  {
+    QString name;
+    QgsFeatureList features;
+    //! placemark id is prefix followed by feature id
+    QString idPrefix;
+    //! document holding styles, empty for the document being written
+    QString styleUrlBase;
+    int nameIndex;
+    int descriptionIndex;
+    Classification classification;
+    //! classification field of unique value or graduated renderer or -1
+    int classificationField;
+    //! style id for single symbol
+    QString styleId;
+    //! all features have styleId, their class was looked up already
+    bool presetStyle;
+    //! style id for each unique value
+    QHash<QString, QString> classStyleIds;
+    //! graduated ranges sorted by upper value and their style ids
+    QVector<double> rangeLowerValues;
+    QVector<double> rangeUpperValues;
+    QStringList rangeStyleIds;
+    //! rule filters, fields they use and style ids of the rules
+    QList< QSharedPointer<QgsSearchString> > ruleFilters;
+    QgsAttributeList ruleFields;
+    QgsFieldMap fields;
+    QStringList ruleStyleIds;
+    //! attributes written as ExtendedData and their escaped names
+    QgsAttributeList extendedDataFields;
+    QStringList extendedDataNames;
+    QString schemaId;
+    CompiledTemplate nameTemplate;
+    CompiledTemplate descriptionTemplate;
+    //! maximum features merged to one MultiGeometry placemark, 0 if not merged
+    int mergeBatchSize;
+    //! coordinates are quantized to decimals, 0 for precision of the data, -1 not quantized
+    int decimals;
+    //! attributes which have to be fetched from provider
+    QgsAttributeList attributes;
+    //! number of point cluster levels, 0 if points are not clustered
+    int clusterLevels;
+    QStringList clusterStyleIds;
+    QgsRectangle extent;
+    //! features are read from the whole layer rather than sent by the tool
+    bool wholeLayer;
+    bool inFolder;
+    //! placemarks encoded ahead by feature id
+    QHash<int, QString> placemarkCache;
+    //! geometries written by the database by feature id, features are read without them
+    QHash<int, QString> geometryKml;
+  };
+
+  //! how geometries of one type are written
+  struct GeometryOptions
+  {
+    QString altitudeMode;
+    int altitude;
+    //! altitude is written with vertices
+    bool hasZValue;
+    int extrude;
+    int tessellate;
+  };
+
+  //! points gathered into one cell of the cluster grid
+  struct PointCluster
+  {
+    int count;
+    double sumX;
+    double sumY;
+  };
+
   QString generateTempFileName();
   QFile *getTempFile();
 
-  QString convertWkbToKml( QgsGeometry *geometry );
+  QString exportToKmlFile( const QString &documentName, const QList<QgsVectorLayer *> &layers,
+                           const QgsFeatureList *flist, const QString &filter = QString(),
+                           const QgsRectangle &rect = QgsRectangle() );
+  QString documentHead( const QString &documentName, const QList<QgsVectorLayer *> &layers,
+                        bool wholeLayers, QList<LayerJob> &jobs );
+  QString writeLayers( const QList<QgsVectorLayer *> &layers, QList<LayerJob> &jobs, const QString &head,
+                       const QgsFeatureList *flist, const QString &filter, const QgsRectangle &rect,
+                       qint64 expectedBytes );
+  QString writeLayerWithCheckpoints( QgsVectorLayer *vlayer, LayerJob &job, const QString &head,
+                                     const QString &filter, const QgsRectangle &rect, qint64 expectedBytes );
+
+  QgsFeatureList sampleFeatures( QgsVectorLayer *vlayer, int maxFeatures, int timeLimit );
+  QgsFeatureList layerFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect,
+                                const QgsAttributeList &attributes, const QString &filter,
+                                bool exact = false, bool fetchGeometry = true );
+  //! kml geometries of the layer written by its database, false if it can not write them
+  bool readDatabaseGeometries( QgsVectorLayer *vlayer, LayerJob &job, const QString &filter,
+                               const QgsRectangle &rect );
+  bool canPushDownGeometries( const LayerJob &job ) const;
+  //! features of a whole shapefile layer read from its mapped files, false if it is not one
+  bool readShapefileFeatures( QgsVectorLayer *vlayer, LayerJob &job );
+  void prepareLayerJob( QgsVectorLayer *vlayer, LayerJob &job, QMap<QString, QString> &styleTable,
+                        QTextStream &stylesOut, QTextStream &out );
+  QString stylesDocument( const QString &styles );
+  void prepareLayerStyles( QgsVectorLayer *vlayer, LayerJob &job,
+                           QMap<QString, QString> &styleTable, QTextStream &out );
+  void prepareLayerStylesV2( QgsVectorLayer *vlayer, LayerJob &job,
+                             QMap<QString, QString> &styleTable, QTextStream &out );
+  QString classStyleId( const LayerJob &job, const QgsAttributeMap &attrMap ) const;
+  //! give the copy of a job its own rule filters, evaluating them is not thread safe
+  void copyRuleFilters( LayerJob &job ) const;
+  void prepareLayerSchema( QgsVectorLayer *vlayer, LayerJob &job, QTextStream &out );
+  QString kmlFieldType( QVariant::Type type );
+  QString placemarksKml( const LayerJob &job ) const;
+  QString placemarkKml( const LayerJob &job, const QgsFeature &feature, const QString &styleId ) const;
+  QString geometryKml( const LayerJob &job, const QgsFeature &feature ) const;
+  QString databaseGeometryKml( const QString &kml ) const;
+  QStringList featurePlacemarks( const LayerJob &job ) const;
+  bool yieldRead( int read, const QPointer<QgsVectorLayer> &layer );
+  bool cachePlacemarks( LayerJob &job, const QgsFeatureList &features );
+  bool canMergeFeatures( const LayerJob &job ) const;
+  QString mergedPlacemarkKml( const LayerJob &job, const QString &styleId, const QStringList &geometries ) const;
+  //! returns number of bytes written
+  qint64 writeFolder( QgsKmlFileWriter &writer, const QString &folder );
+  //! write kml of one part of a partitioned layer, number of placemarks or -1
+  int writePartition( const LayerJob &job, const QString &head, const QString &fileName ) const;
+  QString clustersKml( const LayerJob &job ) const;
+  QString clusterLevelKml( const LayerJob &job, const QList<QgsPoint> &points, int level ) const;
+  QString clusterStyleKml( int sizeClass );
+  int clusterLodPixels( int level ) const;
+  QString regionKml( const QgsRectangle &rect, int minLodPixels, int maxLodPixels ) const;
+
+  bool superOverlayTile( QgsVectorLayer *vlayer, QgsMapRenderer &mapRenderer, const QDir &tilesDir,
+                         const QgsRectangle &rect, int level, int x, int y, int levels,
+                         QList< QFuture<bool> > &pngs );
+  bool saveTileImage( const QImage &image, const QString &fileName ) const;
+
+  //! decimals of coordinates, -1 for 6 decimals without quantization
+  QString convertWkbToKml( QgsGeometry *geometry, int decimals = -1 ) const;
+  void readGeometryOptions();
+  QString pointKml( const QgsPoint &point, bool hasZValue, int decimals ) const;
+  QString lineStringKml( const QgsPolyline &line, int decimals ) const;
+  QString polygonKml( const QgsPolygon &polygon, int decimals ) const;
+  QString coordinatesKml( const QgsPolyline &line, const GeometryOptions &options, int decimals, bool ring ) const;
+  QString coordinateKml( double value, int decimals ) const;
+  QgsPolyline quantizeLine( const QgsPolyline &line, int decimals, bool ring ) const;
+  int sourceDecimals( const QgsFeatureList &features ) const;
+  bool isOnGrid( double value, int decimals ) const;
+  QString compactKml( const QString &kml ) const;
+  void simplifyFeature( QgsFeature &feature, double tolerance, int maxVertices );
+  int vertexCount( QgsGeometry *geometry ) const;
 
   int attributeNameIndex( QgsVectorLayer *vlayer);
   int attributeDescriprionIndex( QgsVectorLayer *vlayer);
 
-  QString styleKmlSingleSymbol( int transp, QgsSymbol *symbol, QString styleId,
-                                QGis::GeometryType typeOfFeature );
-  QString styleKmlUniqueValue( int transp, QString styleId, QList<QgsSymbol *> symbols );
-  QString placemarkNameKml( QgsVectorLayer *vlayer, QgsAttributeMap attrMap );
-  QString placemarkDescriptionKml( QgsVectorLayer *vlayer, QgsAttributeMap attrMap );
+  QString styleKmlSymbol( int transp, QgsSymbol *symbol, bool overrideLayerStyle );
+  QString styleKmlSymbolV2( QgsSymbolV2 *symbol );
+  QString styleKml( QColor color, QColor fillColor, double lineWidth,
+                    int fill, int outline, bool overrideLayerStyle, const QString &iconHref );
+  QString colorModeKml( const QString &colorMode ) const;
+  QString scaleKml( double scale ) const;
+  QString registerIcon( const QImage &image );
+  QByteArray iconPng( const QImage &image ) const;
+  QString packKmz( const QString &kmlFileName );
+  QString registerStyle( const QString &styleId, const QString &styleBody,
+                         QMap<QString, QString> &styleTable, QTextStream &out );
+  QString placemarkNameKml( int index, const QgsAttributeMap &attrMap ) const;
+  CompiledTemplate compileTemplate( QgsVectorLayer *vlayer, const QString &text );
+  QString expandTemplate( const CompiledTemplate &compiled, const QgsAttributeMap &attrMap ) const;
+  QString placemarkDescriptionKml( int index, const QgsAttributeMap &attrMap ) const;
 
   QString featureStyleId( QgsSymbol *symbol, QString styleId );
-  QgsSymbol *symbolForFeature( QgsFeature *feature, const QgsUniqueValueRenderer *urenderer );
 
-  QString removeEscapeChars( QString in );
+  QString removeEscapeChars( QString in ) const;
   QRgb rgba2abgr( QColor color );
 
   QList<QFile *> mTempKmlFiles;
+  QStringList mTempTileDirs;
+  QStringList mStyleFiles;
+  //! converters using each styles document, converters live in the main thread
+  static QHash<QString, int> sStyleFileUsers;
+  QStringList mKmzFiles;
+  //! finished resumable exports, unfinished ones stay to be resumed
+  QStringList mExportFiles;
+
+  int mScannedFeatures;
+  int mExportedFeatures;
+  int mPlacemarks;
+  int mExportTime;
+  int mWriterStallTime;
+  int mWriterIdleTime;
+  bool mFilterPushedDown;
+
+  //! defaults and line breaks between tags are left out
+  bool mCompact;
+  GeometryOptions mPointOptions;
+  GeometryOptions mLineOptions;
+  GeometryOptions mPolyOptions;
+
+  //! point symbols are rendered to icons while styles are prepared
+  bool mEmbedIcons;
+  bool mInlineStyles;
+  ExportStrategy mStrategy;
+  //! rendered icons by their path in kmz
+  QMap<QString, QImage> mIcons;
+
+  //! placemarks encoded ahead, valid for the layer, tolerance and hash of document head
+  QHash<int, QString> mPlacemarkCache;
+  qint64 mPlacemarkCacheBytes;
+  QString mPlacemarkCacheLayerId;
+  double mPlacemarkCacheTolerance;
+  QString mPlacemarkCacheHead;
+  //! changes when placemarks are forgotten
+  int mPlacemarkCacheEdits;
+  //! send of features may take placemarks from the cache
+  bool mUsePlacemarkCache;
+
+  qint64 mExpectedBytes;
+  int mYieldInterval;
+  bool mCanceled;
+  bool mLayerInterrupted;
+  QgsVectorLayer *mReadingLayer;
 };
 
 #endif // QGSKMLCONVERTER_H
@@ -0,0 +1,275 @@
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QVariant>
+
+#include <qgslogger.h>
+#include <qgsvectorlayer.h>
+
+#include <sqlite3.h>
+
+#include "qgskmldatabasereader.h"
+
+// rows fetched from the PostGIS cursor at once
+#define CURSORFETCHSIZE 2000
+
+// readers may run inside each other from the event loop, each has its own
+// connection and cursor
+static int sReaders = 0;
+
+QgsKmlDatabaseReader::QgsKmlDatabaseReader( QgsVectorLayer *vlayer )
+    : mUri( vlayer->source() ), mPostgres( vlayer->providerType() == "postgres" ),
+    mEditable( vlayer->isEditable() ), mSrid( -1 ), mQuery( NULL ), mCursor( false ), mFetched( 0 ), mError( false )
+{
+  sReaders++;
+  if ( mPostgres || vlayer->providerType() == "spatialite" )
+    mConnectionName = QString( "qgis2google-%1-%2" ).arg( vlayer->getLayerID() ).arg( sReaders );
+  mCursorName = QString( "qgis2google_kml_%1" ).arg( sReaders );
+}
+
+QgsKmlDatabaseReader::~QgsKmlDatabaseReader()
+{
+  close();
+  if ( !mConnectionName.isEmpty() && QSqlDatabase::contains( mConnectionName ) )
+  {
+    {
+      QSqlDatabase db = QSqlDatabase::database( mConnectionName, false );
+      db.close();
+    }
+    QSqlDatabase::removeDatabase( mConnectionName );
+  }
+}
+
+// edits are not in the database yet, and features are matched by integer key
+bool QgsKmlDatabaseReader::isAvailable()
+{
+  if ( mConnectionName.isEmpty() || mEditable || mUri.geometryColumn().isEmpty() || !open() )
+    return false;
+
+  QSqlDatabase db = QSqlDatabase::database( mConnectionName );
+  QSqlQuery query( db );
+  if ( mPostgres )
+  {
+    mKeyColumn = mUri.keyColumn();
+    if ( mKeyColumn.isEmpty() )
+    {
+      // the provider takes the primary key when the uri does not name one
+      query.exec( "SELECT a.attname FROM pg_index i JOIN pg_attribute a"
+                  " ON a.attrelid = i.indrelid AND a.attnum = ANY ( i.indkey )"
+                  " WHERE i.indisprimary AND i.indrelid = '" + tableName().replace( "'", "''" ) + "'::regclass" );
+      QStringList keys;
+      while ( query.next() )
+        keys << query.value( 0 ).toString();
+      if ( keys.count() != 1 )
+        return false;
+      mKeyColumn = keys.first();
+    }
+
+    if ( !query.exec( "SELECT ST_AsKML( ST_GeomFromText( 'POINT(0 0)', 4326 ) )" ) || !query.next() )
+    {
+      QgsLogger::debug( QString( "ST_AsKML not available: %1" ).arg( query.lastError().text() ) );
+      return false;
+    }
+
+    // box of the rect has to be in srid of the geometries for the index to be used
+    if ( !query.exec( "SELECT ST_SRID( " + quotedIdentifier( mUri.geometryColumn() ) + " ) FROM " + tableName()
+                      + " WHERE " + quotedIdentifier( mUri.geometryColumn() ) + " IS NOT NULL LIMIT 1" ) )
+      return false;
+    mSrid = query.next() ? query.value( 0 ).toInt() : -1;
+    return isWgs84();
+  }
+
+  // SpatiaLite functions come with the extension, the Qt sqlite driver does not allow
+  // loading extensions, so it is enabled on the handle of the connection
+  mKeyColumn = "ROWID";
+  if ( !query.exec( "SELECT AsKml( GeomFromText( 'POINT(0 0)', 4326 ) )" ) )
+  {
+    QVariant handle = db.driver()->handle();
+    if ( handle.isValid() && qstrcmp( handle.typeName(), "sqlite3*" ) == 0 )
+    {
+      sqlite3 *sqlite = *static_cast<sqlite3 **>( handle.data() );
+      if ( sqlite )
+        sqlite3_enable_load_extension( sqlite, 1 );
+    }
+    query.exec( "SELECT load_extension( 'mod_spatialite' )" );
+    query.exec( "SELECT load_extension( 'libspatialite' )" );
+    if ( !query.exec( "SELECT AsKml( GeomFromText( 'POINT(0 0)', 4326 ) )" ) )
+    {
+      QgsLogger::debug( QString( "AsKml not available: %1" ).arg( query.lastError().text() ) );
+      return false;
+    }
+  }
+  if ( !query.next() || query.value( 0 ).isNull() )
+    return false;
+
+  if ( !query.exec( "SELECT SRID( " + quotedIdentifier( mUri.geometryColumn() ) + " ) FROM " + tableName()
+                    + " WHERE " + quotedIdentifier( mUri.geometryColumn() ) + " IS NOT NULL LIMIT 1" ) )
+    return false;
+  mSrid = query.next() ? query.value( 0 ).toInt() : -1;
+  return isWgs84();
+}
+
+// AsKml transforms to WGS 84, the encoders write coordinates of the layer as they are
+bool QgsKmlDatabaseReader::isWgs84() const
+{
+  if ( mSrid != 4326 )
+    QgsLogger::debug( QString( "Geometries in srid %1, not written by the database" ).arg( mSrid ) );
+  return mSrid == 4326;
+}
+
+bool QgsKmlDatabaseReader::select( const QgsRectangle &rect, const QString &filter, int decimals )
+{
+  close();
+  mError = false;
+  if ( !open() )
+    return false;
+
+  QString geometry = quotedIdentifier( mUri.geometryColumn() );
+  QStringList where;
+  if ( !rect.isEmpty() )
+  {
+    if ( mPostgres )
+      where << QString( "%1 && ST_SetSRID( ST_MakeBox2D( ST_Point( %2, %3 ), ST_Point( %4, %5 ) ), %6 )" )
+      .arg( geometry ).arg( rect.xMinimum(), 0, 'f', 16 ).arg( rect.yMinimum(), 0, 'f', 16 )
+      .arg( rect.xMaximum(), 0, 'f', 16 ).arg( rect.yMaximum(), 0, 'f', 16 ).arg( mSrid );
+    else
+      where << QString( "MbrIntersects( %1, BuildMbr( %2, %3, %4, %5 ) )" )
+      .arg( geometry ).arg( rect.xMinimum(), 0, 'f', 16 ).arg( rect.yMinimum(), 0, 'f', 16 )
+      .arg( rect.xMaximum(), 0, 'f', 16 ).arg( rect.yMaximum(), 0, 'f', 16 );
+  }
+  if ( !mUri.sql().isEmpty() )
+    where << "(" + mUri.sql() + ")";
+  if ( !filter.isEmpty() )
+    where << "(" + filter + ")";
+
+  // kml in WGS 84 is written by the database, ST_AsKML transforms to it
+  QString sql = QString( "SELECT %1, %2( %3, %4 ) FROM %5" )
+                .arg( quotedIdentifier( mKeyColumn ) ).arg( mPostgres ? "ST_AsKML" : "AsKml" )
+                .arg( geometry ).arg( decimals ).arg( tableName() );
+  if ( !where.isEmpty() )
+    sql += " WHERE " + where.join( " AND " );
+
+  QSqlDatabase db = QSqlDatabase::database( mConnectionName );
+  mQuery = new QSqlQuery( db );
+  mQuery->setForwardOnly( true );
+  if ( mPostgres )
+  {
+    // the driver would read the whole result to memory, cursor gives it in batches
+    mCursor = mQuery->exec( "BEGIN" )
+              && mQuery->exec( "DECLARE " + mCursorName + " NO SCROLL CURSOR FOR " + sql )
+              && fetch();
+  }
+  else
+  {
+    mCursor = false;
+    if ( !mQuery->exec( sql ) )
+      mError = true;
+  }
+
+  if ( mError || ( mPostgres && !mCursor ) )
+  {
+    QgsLogger::debug( QString( "Reading kml geometries failed: %1" ).arg( mQuery->lastError().text() ) );
+    mError = true;
+    if ( mPostgres )
+      mQuery->exec( "ROLLBACK" );
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool QgsKmlDatabaseReader::nextGeometry( int &fid, QString &kml )
+{
+  if ( !mQuery )
+    return false;
+
+  while ( !mQuery->next() )
+  {
+    // last batch was shorter, cursor is at the end
+    if ( !mCursor || mFetched < CURSORFETCHSIZE || !fetch() || mFetched == 0 )
+    {
+      close();
+      return false;
+    }
+  }
+
+  bool ok;
+  fid = mQuery->value( 0 ).toInt( &ok );
+  kml = mQuery->value( 1 ).toString();
+  if ( !ok )
+  {
+    mError = true;
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool QgsKmlDatabaseReader::hasError() const
+{
+  return mError;
+}
+
+bool QgsKmlDatabaseReader::open()
+{
+  if ( QSqlDatabase::contains( mConnectionName ) )
+    return QSqlDatabase::database( mConnectionName ).isOpen();
+
+  QSqlDatabase db = QSqlDatabase::addDatabase( mPostgres ? "QPSQL" : "QSQLITE", mConnectionName );
+  db.setDatabaseName( mUri.database() );
+  if ( mPostgres )
+  {
+    db.setHostName( mUri.host() );
+    if ( !mUri.port().isEmpty() )
+      db.setPort( mUri.port().toInt() );
+    db.setUserName( mUri.username() );
+    db.setPassword( mUri.password() );
+  }
+
+  if ( !db.open() )
+  {
+    QgsLogger::debug( QString( "Unable to connect to %1: %2" ).arg( mUri.database() ).arg( db.lastError().text() ) );
+    return false;
+  }
+  return true;
+}
+
+bool QgsKmlDatabaseReader::fetch()
+{
+  if ( !mQuery->exec( QString( "FETCH FORWARD %1 FROM %2" ).arg( CURSORFETCHSIZE ).arg( mCursorName ) ) )
+  {
+    mError = true;
+    return false;
+  }
+  mFetched = mQuery->size();
+  return true;
+}
+
+void QgsKmlDatabaseReader::close()
+{
+  if ( !mQuery )
+    return;
+
+  if ( mCursor )
+  {
+    mQuery->exec( "CLOSE " + mCursorName );
+    mQuery->exec( "COMMIT" );
+    mCursor = false;
+  }
+  delete mQuery;
+  mQuery = NULL;
+}
+
+QString QgsKmlDatabaseReader::quotedIdentifier( QString name ) const
+{
+  return "\"" + name.replace( "\"", "\"\"" ) + "\"";
+}
+
+QString QgsKmlDatabaseReader::tableName() const
+{
+  if ( mPostgres && !mUri.schema().isEmpty() )
+    return quotedIdentifier( mUri.schema() ) + "." + quotedIdentifier( mUri.table() );
+  return quotedIdentifier( mUri.table() );
+}
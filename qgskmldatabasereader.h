@@ -0,0 +1,61 @@
+#ifndef QGSKMLDATABASEREADER_H
+#define QGSKMLDATABASEREADER_H
+
+#include <QString>
+
+#include <qgsdatasourceuri.h>
+#include <qgsrectangle.h>
+
+class QSqlQuery;
+class QgsVectorLayer;
+
+/**
+* \class QgsKmlDatabaseReader
+* \brief Kml geometries of a PostGIS or SpatiaLite layer written by the database
+* ST_AsKML or AsKml run in the database next to the data, so geometries do not
+* go through the provider to be encoded by the plugin. Rows are read through a
+* cursor like features of a layer. The reader is not available when the layer
+* is edited, has no integer key, is not in WGS 84 or the database lacks the functions.
+* Each reader has its own connection, so readers may run inside each other.
+*/
+class QgsKmlDatabaseReader
+{
+public:
+  QgsKmlDatabaseReader( QgsVectorLayer *vlayer );
+  ~QgsKmlDatabaseReader();
+
+  //! database is reachable and writes kml
+  bool isAvailable();
+  //! start reading geometries of features intersecting rect (all for empty rect) and
+  //! matching filter (sql where clause) with coordinates rounded to decimals
+  bool select( const QgsRectangle &rect, const QString &filter, int decimals );
+  //! feature id and kml geometry of the next feature, false at the end or on error
+  bool nextGeometry( int &fid, QString &kml );
+  //! reading stopped before the end
+  bool hasError() const;
+
+private:
+  bool open();
+  bool fetch();
+  void close();
+  bool isWgs84() const;
+  QString quotedIdentifier( QString name ) const;
+  QString tableName() const;
+
+  QgsDataSourceURI mUri;
+  bool mPostgres;
+  bool mEditable;
+  QString mConnectionName;
+  QString mCursorName;
+  QString mKeyColumn;
+  //! srid of the geometries
+  int mSrid;
+
+  QSqlQuery *mQuery;
+  //! rows are fetched from a server side cursor in batches
+  bool mCursor;
+  int mFetched;
+  bool mError;
+};
+
+#endif // QGSKMLDATABASEREADER_H
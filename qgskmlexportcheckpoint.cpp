@@ -0,0 +1,105 @@
+#include <QCryptographicHash>
+#include <QFile>
+#include <QSettings>
+
+#include "qgskmlexportcheckpoint.h"
+
+// bytes at the end of the written part of kml compared before resuming
+#define CHECKPOINTTAILSIZE 65536
+
+QgsKmlExportCheckpoint::QgsKmlExportCheckpoint( const QString &kmlFileName, const QString &key )
+    : mKmlFileName( kmlFileName ), mFileName( kmlFileName + ".checkpoint" ), mKey( key ),
+    mFeatures( 0 ), mLastFeatureId( -1 ), mOffset( 0 )
+{
+}
+
+bool QgsKmlExportCheckpoint::load()
+{
+  mFeatures = 0;
+  mLastFeatureId = -1;
+  mOffset = 0;
+  if ( !QFile::exists( mFileName ) )
+    return false;
+
+  QSettings checkpoint( mFileName, QSettings::IniFormat );
+  if ( checkpoint.value( "key" ).toString() != mKey )
+    return false;
+
+  int features = checkpoint.value( "features" ).toInt();
+  qint64 offset = checkpoint.value( "offset" ).toLongLong();
+  if ( features <= 0 || offset <= 0 || tailHash( offset ) != checkpoint.value( "tail" ).toString() )
+    return false;
+
+  mFeatures = features;
+  mLastFeatureId = checkpoint.value( "lastfeatureid" ).toInt();
+  mOffset = offset;
+  return true;
+}
+
+// written to another file and renamed, so a crash leaves the old checkpoint or the new one
+bool QgsKmlExportCheckpoint::save( int features, int lastFeatureId, qint64 offset )
+{
+  QString newFileName = mFileName + ".new";
+  QFile::remove( newFileName );
+  {
+    QSettings checkpoint( newFileName, QSettings::IniFormat );
+    checkpoint.setValue( "key", mKey );
+    checkpoint.setValue( "features", features );
+    checkpoint.setValue( "lastfeatureid", lastFeatureId );
+    checkpoint.setValue( "offset", offset );
+    checkpoint.setValue( "tail", tailHash( offset ) );
+    checkpoint.sync();
+    if ( checkpoint.status() != QSettings::NoError )
+      return false;
+  }
+
+  QFile::remove( mFileName );
+  if ( !QFile::rename( newFileName, mFileName ) )
+    return false;
+
+  mFeatures = features;
+  mLastFeatureId = lastFeatureId;
+  mOffset = offset;
+  return true;
+}
+
+void QgsKmlExportCheckpoint::remove()
+{
+  QFile::remove( mFileName );
+  mFeatures = 0;
+  mLastFeatureId = -1;
+  mOffset = 0;
+}
+
+int QgsKmlExportCheckpoint::features() const
+{
+  return mFeatures;
+}
+
+int QgsKmlExportCheckpoint::lastFeatureId() const
+{
+  return mLastFeatureId;
+}
+
+qint64 QgsKmlExportCheckpoint::offset() const
+{
+  return mOffset;
+}
+
+// hash of the kml bytes just before offset, empty if the kml is shorter
+QString QgsKmlExportCheckpoint::tailHash( qint64 offset ) const
+{
+  QFile kmlFile( mKmlFileName );
+  if ( !kmlFile.open( QIODevice::ReadOnly ) || kmlFile.size() < offset )
+    return QString();
+
+  qint64 start = qMax( offset - CHECKPOINTTAILSIZE, qint64( 0 ) );
+  if ( !kmlFile.seek( start ) )
+    return QString();
+
+  QByteArray tail = kmlFile.read( offset - start );
+  if ( tail.size() != offset - start )
+    return QString();
+
+  return QCryptographicHash::hash( tail, QCryptographicHash::Md5 ).toHex();
+}
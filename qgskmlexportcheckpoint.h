@@ -0,0 +1,42 @@
+#ifndef QGSKMLEXPORTCHECKPOINT_H
+#define QGSKMLEXPORTCHECKPOINT_H
+
+#include <QString>
+
+/**
+* \class QgsKmlExportCheckpoint
+* \brief Progress of a layer export saved next to its kml
+* The export records how many features are on the disk, the id of the last one
+* and where the kml ends after it. A restarted export of the same layer with the
+* same options checks the kml against the checkpoint and appends to it.
+*/
+class QgsKmlExportCheckpoint
+{
+public:
+  //! checkpoint of the kml file, key identifies the layer, filter, options and styles
+  QgsKmlExportCheckpoint( const QString &kmlFileName, const QString &key );
+
+  //! read checkpoint of the same key, false if there is none or the kml does not end as it says
+  bool load();
+  //! features are written and the kml ends at offset after them
+  bool save( int features, int lastFeatureId, qint64 offset );
+  //! export is finished, there is nothing to resume
+  void remove();
+
+  int features() const;
+  int lastFeatureId() const;
+  qint64 offset() const;
+
+private:
+  QString tailHash( qint64 offset ) const;
+
+  QString mKmlFileName;
+  QString mFileName;
+  QString mKey;
+
+  int mFeatures;
+  int mLastFeatureId;
+  qint64 mOffset;
+};
+
+#endif // QGSKMLEXPORTCHECKPOINT_H
@@ -0,0 +1,417 @@
+#include <QPointer>
+#include <QTimer>
+
+#include <qgsmapcanvas.h>
+#include <qgsmaplayerregistry.h>
+#include <qgsvectorlayer.h>
+
+#include "qgskmlexportscheduler.h"
+
+// how many features are read between event loop runs
+#define BULKYIELDINTERVAL 2000
+#define INTERACTIVEYIELDINTERVAL 500
+
+QgsKmlExportScheduler::QgsKmlExportScheduler( QgsMapCanvas *canvas, QObject *parent )
+    : QObject( parent ), mCanvas( canvas ),
+    mInteractiveConverter( new QgsKmlConverter ), mBulkConverter( new QgsKmlConverter ),
+    mRunningInteractive( false ), mRunningBulk( false ), mRunningSpeculative( false )
+{
+  mInteractiveConverter->setYieldInterval( INTERACTIVEYIELDINTERVAL );
+  mBulkConverter->setYieldInterval( BULKYIELDINTERVAL );
+  connect( mCanvas, SIGNAL( renderComplete( QPainter * ) ), SLOT( canvasRendered() ) );
+  connect( QgsMapLayerRegistry::instance(), SIGNAL( layerWillBeRemoved( QString ) ),
+           SLOT( layerWillBeRemoved( QString ) ) );
+}
+
+// unloaded from the event loop of an export, the running converter stops at its
+// next yield and is deleted by run()
+QgsKmlExportScheduler::~QgsKmlExportScheduler()
+{
+  if ( mRunningInteractive || mRunningSpeculative )
+    mInteractiveConverter->setCanceled( true );
+  else
+    delete mInteractiveConverter;
+
+  if ( mRunningBulk )
+    mBulkConverter->setCanceled( true );
+  else
+    delete mBulkConverter;
+}
+
+void QgsKmlExportScheduler::sendFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance )
+{
+  ExportRequest request;
+  request.priority = Interactive;
+  request.type = Features;
+  request.layerIds << vlayer->getLayerID();
+  request.rect = rect;
+  request.tolerance = tolerance;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::sendLayer( QgsVectorLayer *vlayer, const QString &filter, const QgsRectangle &rect,
+                                       QgsKmlConverter::ExportStrategy strategy, qint64 expectedBytes )
+{
+  ExportRequest request;
+  request.priority = Bulk;
+  request.type = Layer;
+  request.tolerance = 0.0;
+  request.strategy = strategy;
+  request.expectedBytes = expectedBytes;
+  request.layerIds << vlayer->getLayerID();
+  request.rect = rect;
+  request.filter = filter;
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::sendLayers( const QList<QgsVectorLayer *> &layers )
+{
+  ExportRequest request;
+  request.priority = Bulk;
+  request.type = Layers;
+  request.tolerance = 0.0;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  foreach ( QgsVectorLayer *vlayer, layers )
+    request.layerIds << vlayer->getLayerID();
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::sendLayerTiles( QgsVectorLayer *vlayer )
+{
+  ExportRequest request;
+  request.priority = Bulk;
+  request.type = Tiles;
+  request.tolerance = 0.0;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  request.layerIds << vlayer->getLayerID();
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::sendLayerPartitions( QgsVectorLayer *vlayer )
+{
+  ExportRequest request;
+  request.priority = Bulk;
+  request.type = Partitions;
+  request.tolerance = 0.0;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  request.layerIds << vlayer->getLayerID();
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::sendLayerPreview( QgsVectorLayer *vlayer )
+{
+  ExportRequest request;
+  request.priority = Interactive;
+  request.type = Preview;
+  request.tolerance = 0.0;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  request.layerIds << vlayer->getLayerID();
+  enqueue( request );
+}
+
+void QgsKmlExportScheduler::preEncodeFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance )
+{
+  watchLayer( vlayer );
+
+  ExportRequest request;
+  request.priority = Speculative;
+  request.type = PreEncode;
+  request.tolerance = tolerance;
+  request.strategy = QgsKmlConverter::PlainKml;
+  request.expectedBytes = 0;
+  request.layerIds << vlayer->getLayerID();
+  request.rect = rect;
+  enqueue( request );
+}
+
+QgsKmlConverter::ExportEstimate QgsKmlExportScheduler::estimateLayer( QgsVectorLayer *vlayer )
+{
+  // estimate reads the layer
+  cancelSpeculative();
+
+  QgsKmlConverter converter;
+  QgsKmlConverter::ExportEstimate estimate = converter.estimateLayerExport( vlayer );
+
+  // reading of the layer export was disturbed
+  if ( mRunningBulk && mBulkLayerIds.contains( vlayer->getLayerID() ) )
+    mBulkConverter->layerInterrupted( vlayer );
+
+  return estimate;
+}
+
+int QgsKmlExportScheduler::pendingCount() const
+{
+  return mQueue.count();
+}
+
+bool QgsKmlExportScheduler::isBusy() const
+{
+  return mRunningInteractive || mRunningBulk || mRunningSpeculative;
+}
+
+void QgsKmlExportScheduler::enqueue( ExportRequest &request )
+{
+  request.key = QString::number( request.type ) + "|" + request.layerIds.join( "," ) + "|"
+                + request.rect.toString() + "|" + request.filter + "|" + QString::number( request.tolerance )
+                + "|" + QString::number( request.strategy ) + "|" + QgsKmlConverter::optionsFingerprint();
+
+  // identical request is already waiting
+  foreach ( const ExportRequest &pending, mQueue )
+  {
+    if ( pending.key == request.key )
+      return;
+  }
+
+  // encoding ahead gives way to everything else, it is done again later
+  cancelSpeculative();
+
+  if ( request.priority == Speculative )
+  {
+    // view changed, the previous one is not worth encoding
+    for ( int i = mQueue.count() - 1; i >= 0; i-- )
+    {
+      if ( mQueue.at( i ).priority == Speculative )
+        mQueue.removeAt( i );
+    }
+    mQueue.append( request );
+  }
+  else if ( request.priority == Interactive )
+  {
+    // newer click supersedes older ones, waiting or running
+    for ( int i = mQueue.count() - 1; i >= 0; i-- )
+    {
+      if ( mQueue.at( i ).priority == Interactive )
+        mQueue.removeAt( i );
+    }
+    if ( mRunningInteractive )
+      mInteractiveConverter->setCanceled( true );
+
+    // interactive requests go ahead of layer exports
+    int i = 0;
+    while ( i < mQueue.count() && mQueue.at( i ).priority == Interactive )
+      i++;
+    mQueue.insert( i, request );
+  }
+  else
+  {
+    // layer exports wait behind each other, ahead of encoding
+    int i = mQueue.count();
+    while ( i > 0 && mQueue.at( i - 1 ).priority == Speculative )
+      i--;
+    mQueue.insert( i, request );
+  }
+
+  if ( mRunningBulk && !mRunningInteractive && request.priority == Interactive )
+  {
+    // we are called from the event loop run by the layer export, send right now
+    runNext();
+  }
+  else if ( !isBusy() )
+  {
+    QTimer::singleShot( 0, this, SLOT( runNext() ) );
+  }
+}
+
+void QgsKmlExportScheduler::runNext()
+{
+  while ( !mQueue.isEmpty() )
+  {
+    // only an interactive send may run inside a layer export
+    if ( mRunningInteractive || mRunningSpeculative
+         || ( mRunningBulk && mQueue.first().priority != Interactive ) )
+      return;
+
+    QPointer<QgsKmlExportScheduler> guard( this );
+    ExportRequest request = mQueue.takeFirst();
+    run( request );
+    if ( !guard )
+      return;
+  }
+}
+
+void QgsKmlExportScheduler::run( const ExportRequest &request )
+{
+  QList<QgsVectorLayer *> layers = requestLayers( request );
+  if ( layers.isEmpty() )
+    return;
+
+  // events processed by the export may delete this scheduler
+  QPointer<QgsKmlExportScheduler> guard( this );
+  QString fileName;
+  QString statistics;
+  if ( request.priority == Speculative )
+  {
+    QgsKmlConverter *converter = mInteractiveConverter;
+    mRunningSpeculative = true;
+    mInteractiveLayerId = request.layerIds.first();
+    converter->setCanceled( false );
+    bool done = converter->preEncodeFeatures( layers.first(), request.rect, request.tolerance );
+    if ( !guard )
+    {
+      delete converter;
+      return;
+    }
+    mRunningSpeculative = false;
+    mInteractiveLayerId.clear();
+
+    // interrupted by another request, goes on after it unless the view changed meanwhile
+    bool superseded = false;
+    foreach ( const ExportRequest &pending, mQueue )
+      superseded = superseded || pending.priority == Speculative;
+    if ( !done && !superseded )
+      mQueue.append( request );
+    return;
+  }
+  else if ( request.priority == Interactive )
+  {
+    QgsKmlConverter *converter = mInteractiveConverter;
+    mRunningInteractive = true;
+    mInteractiveLayerId = request.layerIds.first();
+    converter->setCanceled( false );
+    if ( request.type == Preview )
+      fileName = converter->exportLayerPreview( layers.first() );
+    else
+      fileName = converter->exportFeaturesToKmlFile( layers.first(), request.rect, request.tolerance );
+    if ( !guard )
+    {
+      delete converter;
+      return;
+    }
+    mRunningInteractive = false;
+    mInteractiveLayerId.clear();
+
+    // reading of the layer export was disturbed, unless the layer is gone
+    if ( mRunningBulk && mBulkLayerIds.contains( request.layerIds.first() ) && !mInteractiveConverter->isCanceled() )
+      mBulkConverter->layerInterrupted( layers.first() );
+
+    if ( mInteractiveConverter->isCanceled() )
+      fileName = QString();
+  }
+  else
+  {
+    // canvas keeps rendering, reads of the layers it disturbs go on, see canvasRendered()
+    QgsKmlConverter *converter = mBulkConverter;
+    mRunningBulk = true;
+    mBulkLayerIds = request.layerIds;
+    converter->setCanceled( false );
+
+    switch ( request.type )
+    {
+    case Layer:
+      converter->setStrategy( request.strategy );
+      converter->setExpectedBytes( request.expectedBytes );
+      fileName = converter->exportLayerToKmlFile( layers.first(), request.filter, request.rect );
+      converter->setExpectedBytes( 0 );
+      converter->setStrategy( QgsKmlConverter::PlainKml );
+      statistics = converter->exportStatistics();
+      break;
+    case Layers:
+      fileName = converter->exportLayersToKmlFile( layers );
+      statistics = converter->exportStatistics();
+      break;
+    case Tiles:
+      fileName = converter->exportLayerToSuperOverlay( layers.first() );
+      break;
+    case Partitions:
+      fileName = converter->exportLayerToPartitions( layers.first() );
+      statistics = converter->exportStatistics();
+      break;
+    case Features:
+    case Preview:
+      break;
+    }
+
+    if ( !guard )
+    {
+      delete converter;
+      return;
+    }
+    mRunningBulk = false;
+    mBulkLayerIds.clear();
+    if ( converter->isCanceled() )
+      fileName = QString();
+  }
+
+  if ( !fileName.isEmpty() )
+    emit exportFinished( fileName, statistics );
+}
+
+// rendering read the layers, exports reading them through the layers themselves go on
+// after the features they have
+void QgsKmlExportScheduler::canvasRendered()
+{
+  cancelSpeculative();
+
+  if ( mRunningBulk )
+  {
+    foreach ( QString layerId, mBulkLayerIds )
+    {
+      QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer *>( QgsMapLayerRegistry::instance()->mapLayer( layerId ) );
+      if ( vlayer )
+        mBulkConverter->layerInterrupted( vlayer );
+    }
+  }
+}
+
+void QgsKmlExportScheduler::cancelSpeculative()
+{
+  if ( mRunningSpeculative )
+    mInteractiveConverter->setCanceled( true );
+}
+
+// converters do not touch layers of a canceled export after events are processed
+void QgsKmlExportScheduler::layerWillBeRemoved( QString layerId )
+{
+  if ( ( mRunningInteractive || mRunningSpeculative ) && mInteractiveLayerId == layerId )
+    mInteractiveConverter->setCanceled( true );
+  if ( mRunningBulk && mBulkLayerIds.contains( layerId ) )
+    mBulkConverter->setCanceled( true );
+  if ( mWatchedLayerId == layerId )
+    mWatchedLayerId.clear();
+}
+
+void QgsKmlExportScheduler::featureEdited( int fid )
+{
+  mInteractiveConverter->forgetPlacemark( fid );
+}
+
+// ids of added features change when edits are saved
+void QgsKmlExportScheduler::layerEditingStopped()
+{
+  mInteractiveConverter->clearPlacemarkCache();
+}
+
+void QgsKmlExportScheduler::watchLayer( QgsVectorLayer *vlayer )
+{
+  if ( vlayer->getLayerID() == mWatchedLayerId )
+    return;
+
+  QgsVectorLayer *watched = dynamic_cast<QgsVectorLayer *>( QgsMapLayerRegistry::instance()->mapLayer( mWatchedLayerId ) );
+  if ( watched )
+    disconnect( watched, 0, this, 0 );
+
+  mWatchedLayerId = vlayer->getLayerID();
+  connect( vlayer, SIGNAL( featureDeleted( int ) ), SLOT( featureEdited( int ) ) );
+  connect( vlayer, SIGNAL( geometryChanged( int, QgsGeometry & ) ), SLOT( featureEdited( int ) ) );
+  connect( vlayer, SIGNAL( attributeValueChanged( int, int, const QVariant & ) ), SLOT( featureEdited( int ) ) );
+  connect( vlayer, SIGNAL( editingStopped() ), SLOT( layerEditingStopped() ) );
+}
+
+// layers may be removed from project while the request waits
+QList<QgsVectorLayer *> QgsKmlExportScheduler::requestLayers( const ExportRequest &request )
+{
+  QList<QgsVectorLayer *> layers;
+  foreach ( QString layerId, request.layerIds )
+  {
+    QgsVectorLayer *vlayer = dynamic_cast<QgsVectorLayer *>( QgsMapLayerRegistry::instance()->mapLayer( layerId ) );
+    if ( vlayer )
+      layers << vlayer;
+  }
+  return layers;
+}
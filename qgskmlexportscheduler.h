@@ -0,0 +1,128 @@
+#ifndef QGSKMLEXPORTSCHEDULER_H
+#define QGSKMLEXPORTSCHEDULER_H
+
+#include <QList>
+#include <QObject>
+#include <QStringList>
+
+#include <qgsrectangle.h>
+
+#include "qgskmlconverter.h"
+
+class QgsMapCanvas;
+class QgsVectorLayer;
+
+/**
+* \class QgsKmlExportScheduler
+* \brief Queue of kml exports of the plugin
+* Interactive sends of clicked features go ahead of layer exports and run even
+* while a layer export is in progress, a newer click cancels an older one,
+* identical pending requests are merged. Speculative encoding of features in
+* view runs only when nothing else is to be done and yields to any other request.
+*/
+class QgsKmlExportScheduler : public QObject
+{
+  Q_OBJECT
+public:
+  enum Priority
+  {
+    Interactive = 0,
+    Bulk,
+    Speculative
+  };
+
+  QgsKmlExportScheduler( QgsMapCanvas *canvas, QObject *parent = 0 );
+  ~QgsKmlExportScheduler();
+
+  //! send features of the layer intersecting rect (in layer coordinates),
+  //! simplified to tolerance (in layer units) if it is not 0
+  void sendFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance = 0.0 );
+  //! send features of the layer matching filter found in rect, whole layer by default,
+  //! strategy applies to this export only, expectedBytes is the estimated size of the whole layer
+  void sendLayer( QgsVectorLayer *vlayer, const QString &filter = QString(),
+                  const QgsRectangle &rect = QgsRectangle(),
+                  QgsKmlConverter::ExportStrategy strategy = QgsKmlConverter::PlainKml,
+                  qint64 expectedBytes = 0 );
+  void sendLayers( const QList<QgsVectorLayer *> &layers );
+  void sendLayerTiles( QgsVectorLayer *vlayer );
+  //! send each value of the partition field or each class of the layer to its own kml
+  void sendLayerPartitions( QgsVectorLayer *vlayer );
+  //! send a sample of features spread over the layer extent
+  void sendLayerPreview( QgsVectorLayer *vlayer );
+  //! encode features in rect (layer coordinates) ahead of a send with the same tolerance,
+  //! replaces the previous pre-encoding
+  void preEncodeFeatures( QgsVectorLayer *vlayer, const QgsRectangle &rect, double tolerance = 0.0 );
+
+  //! estimate of the layer export, may be called while a layer export runs
+  QgsKmlConverter::ExportEstimate estimateLayer( QgsVectorLayer *vlayer );
+
+  int pendingCount() const;
+  bool isBusy() const;
+
+signals:
+  //! kml file is ready to be opened, statistics is empty for feature sends
+  void exportFinished( const QString &fileName, const QString &statistics );
+
+private slots:
+  void runNext();
+  //! placemarks encoded ahead are not valid after edits
+  void featureEdited( int fid );
+  void layerEditingStopped();
+  //! rendering reads the layers being exported
+  void canvasRendered();
+  //! rendering reads the layer being pre-encoded
+  void cancelSpeculative();
+  //! exports reading the layer are canceled before it is deleted
+  void layerWillBeRemoved( QString layerId );
+
+private:
+  enum RequestType
+  {
+    Features,
+    Layer,
+    Layers,
+    Tiles,
+    Partitions,
+    Preview,
+    PreEncode
+  };
+
+  struct ExportRequest
+  {
+    Priority priority;
+    RequestType type;
+    QStringList layerIds;
+    QgsRectangle rect;
+    QString filter;
+    double tolerance;
+    //! chosen for this request, not stored in the settings
+    QgsKmlConverter::ExportStrategy strategy;
+    //! size estimated before sending, 0 when not known
+    qint64 expectedBytes;
+    //! equal for identical requests
+    QString key;
+  };
+
+  void enqueue( ExportRequest &request );
+  void run( const ExportRequest &request );
+  QList<QgsVectorLayer *> requestLayers( const ExportRequest &request );
+  void watchLayer( QgsVectorLayer *vlayer );
+
+  QgsMapCanvas *mCanvas;
+
+  //! converters are separate, so that a send may run inside a layer export,
+  //! the interactive one keeps placemarks encoded ahead
+  QgsKmlConverter *mInteractiveConverter;
+  QgsKmlConverter *mBulkConverter;
+
+  QList<ExportRequest> mQueue;
+  bool mRunningInteractive;
+  bool mRunningBulk;
+  bool mRunningSpeculative;
+  QStringList mBulkLayerIds;
+  QString mInteractiveLayerId;
+  //! layer whose edits invalidate placemarks encoded ahead
+  QString mWatchedLayerId;
+};
+
+#endif // QGSKMLEXPORTSCHEDULER_H
@@ -0,0 +1,155 @@
+#include <QFile>
+#include <QMutexLocker>
+#include <QTime>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+#include "qgskmlfilewriter.h"
+
+// size of one buffer and number of buffers owned by the writer thread, one
+// buffer is written while the producer fills another
+#define WRITERBUFFERSIZE 1048576
+#define WRITERBUFFERS 1
+
+QgsKmlFileWriter::QgsKmlFileWriter( QFile *file, qint64 preallocateSize )
+    : mFile( file ), mPreallocateSize( preallocateSize ), mWritten( 0 ),
+    mFinished( false ), mError( false ), mStallTime( 0 ), mIdleTime( 0 )
+{
+  mBuffer.reserve( WRITERBUFFERSIZE );
+
+  // blocks of the file are reserved in one step instead of many small ones, so the
+  // kml is not fragmented. Resizing would only make a sparse file, so files are not
+  // preallocated where fallocate is missing. Data written before is kept.
+  qint64 begin = mFile->pos();
+#ifdef Q_OS_LINUX
+  mFile->flush();
+  if ( mPreallocateSize <= begin || posix_fallocate( mFile->handle(), begin, mPreallocateSize - begin ) != 0 )
+    mPreallocateSize = 0;
+#else
+  mPreallocateSize = 0;
+#endif
+  mFile->seek( begin );
+  mWritten = mFile->pos();
+
+  start();
+}
+
+QgsKmlFileWriter::~QgsKmlFileWriter()
+{
+  finish();
+}
+
+// data is walked once, whole buffers of it are queued without going through mBuffer
+void QgsKmlFileWriter::write( const QByteArray &data )
+{
+  int offset = 0;
+  while ( offset < data.size() )
+  {
+    int size = qMin( WRITERBUFFERSIZE - mBuffer.size(), data.size() - offset );
+    if ( mBuffer.isEmpty() && size == WRITERBUFFERSIZE )
+    {
+      queueBuffer( data.mid( offset, size ) );
+    }
+    else
+    {
+      mBuffer.append( data.constData() + offset, size );
+      if ( mBuffer.size() == WRITERBUFFERSIZE )
+      {
+        queueBuffer( mBuffer );
+        mBuffer.clear();
+        mBuffer.reserve( WRITERBUFFERSIZE );
+      }
+    }
+    offset += size;
+  }
+}
+
+bool QgsKmlFileWriter::finish()
+{
+  if ( isFinished() )
+    return !mError;
+
+  if ( !mBuffer.isEmpty() )
+  {
+    queueBuffer( mBuffer );
+    mBuffer.clear();
+  }
+
+  mMutex.lock();
+  mFinished = true;
+  mBufferQueued.wakeAll();
+  mMutex.unlock();
+  wait();
+
+  // cut off the rest of preallocated space
+  mFile->flush();
+  if ( mPreallocateSize > 0 && mWritten != mPreallocateSize )
+    mFile->resize( mWritten );
+
+  return !mError;
+}
+
+qint64 QgsKmlFileWriter::writtenBytes()
+{
+  QMutexLocker locker( &mMutex );
+  return mWritten;
+}
+
+int QgsKmlFileWriter::stallTime() const
+{
+  return mStallTime;
+}
+
+int QgsKmlFileWriter::idleTime() const
+{
+  return mIdleTime;
+}
+
+void QgsKmlFileWriter::queueBuffer( const QByteArray &buffer )
+{
+  QMutexLocker locker( &mMutex );
+
+  QTime stall;
+  stall.start();
+  while ( mQueue.count() >= WRITERBUFFERS )
+    mBufferWritten.wait( &mMutex );
+  mStallTime += stall.elapsed();
+
+  mQueue.enqueue( buffer );
+  mBufferQueued.wakeOne();
+}
+
+void QgsKmlFileWriter::run()
+{
+  forever
+  {
+    mMutex.lock();
+    QTime idle;
+    idle.start();
+    while ( mQueue.isEmpty() && !mFinished )
+      mBufferQueued.wait( &mMutex );
+    mIdleTime += idle.elapsed();
+
+    if ( mQueue.isEmpty() )
+    {
+      mMutex.unlock();
+      break;
+    }
+
+    // buffer stays queued while written, the producer fills the other one meanwhile
+    QByteArray buffer = mQueue.head();
+    mMutex.unlock();
+
+    // written part is handed to the system, so it survives a crash of the application
+    if ( mFile->write( buffer ) != buffer.size() || !mFile->flush() )
+      mError = true;
+
+    mMutex.lock();
+    mWritten += buffer.size();
+    mQueue.dequeue();
+    mBufferWritten.wakeOne();
+    mMutex.unlock();
+  }
+}
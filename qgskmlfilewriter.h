@@ -0,0 +1,64 @@
+#ifndef QGSKMLFILEWRITER_H
+#define QGSKMLFILEWRITER_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+class QFile;
+
+/**
+* \class QgsKmlFileWriter
+* \brief Writes kml to the file in its own thread
+* Data is cut to fixed-size buffers, one is written while the next one is
+* filled, so write() blocks when the disk is slower than encoding. Time spent waiting
+* on both sides is recorded.
+*/
+class QgsKmlFileWriter : public QThread
+{
+public:
+  //! file must be open, data goes from its current position and blocks up to
+  //! preallocateSize bytes are allocated before writing where the system can do it
+  QgsKmlFileWriter( QFile *file, qint64 preallocateSize = 0 );
+  ~QgsKmlFileWriter();
+
+  //! queue data to be written, blocks while all buffers are waiting for the disk
+  void write( const QByteArray &data );
+  //! write the rest of data and stop the thread, false if writing failed
+  bool finish();
+
+  //! end of the data in the file written so far
+  qint64 writtenBytes();
+
+  //! ms the producer was blocked by the disk
+  int stallTime() const;
+  //! ms the writer thread waited for data
+  int idleTime() const;
+
+protected:
+  void run();
+
+private:
+  void queueBuffer( const QByteArray &buffer );
+
+  QFile *mFile;
+  qint64 mPreallocateSize;
+  qint64 mWritten;
+
+  //! buffer being filled by the producer
+  QByteArray mBuffer;
+  //! full buffers waiting for the disk
+  QQueue<QByteArray> mQueue;
+  QMutex mMutex;
+  QWaitCondition mBufferQueued;
+  QWaitCondition mBufferWritten;
+  bool mFinished;
+  bool mError;
+
+  int mStallTime;
+  int mIdleTime;
+};
+
+#endif // QGSKMLFILEWRITER_H
@@ -0,0 +1,352 @@
+#include <cstdio>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QMetaObject>
+#include <QPointer>
+#include <QRunnable>
+#include <QSettings>
+#include <QTime>
+
+#include <qgslogger.h>
+#include <qgsvectorlayer.h>
+
+#include "qgskmlconverter.h"
+#include "qgskmlfolderwatcher.h"
+
+// folders have to be quiet so long before they are scanned (ms)
+#define WATCHQUIETTIME 2000
+// bytes of a dataset hashed at once
+#define WATCHHASHBLOCKSIZE 1048576
+// features read by an export between event loop runs
+#define WATCHYIELDINTERVAL 2000
+
+// files of a dataset, shapefile comes with its sidecars
+static QStringList datasetFiles( const QString &fileName )
+{
+  QFileInfo info( fileName );
+  if ( info.suffix().compare( "shp", Qt::CaseInsensitive ) != 0 )
+    return QStringList() << fileName;
+
+  QStringList files;
+  QDir dir = info.absoluteDir();
+  foreach ( QString sidecar, dir.entryList( QStringList() << info.completeBaseName() + ".*", QDir::Files, QDir::Name ) )
+  {
+    QString suffix = QFileInfo( sidecar ).suffix().toLower();
+    if ( suffix == "shp" || suffix == "shx" || suffix == "dbf" || suffix == "prj" || suffix == "cpg" )
+      files << dir.absoluteFilePath( sidecar );
+  }
+  return files;
+}
+
+/**
+* \brief md5 of the content of the dataset files, run by the pool of the watcher
+*/
+class QgsKmlFingerprintTask : public QRunnable
+{
+public:
+  QgsKmlFingerprintTask( QObject *receiver, const QString &fileName, QAtomicInt *canceled )
+      : mReceiver( receiver ), mFileName( fileName ), mCanceled( canceled )
+  {
+  }
+
+  void run()
+  {
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    foreach ( QString fileName, datasetFiles( mFileName ) )
+    {
+      QFile file( fileName );
+      if ( !file.open( QIODevice::ReadOnly ) )
+        continue;
+      hash.addData( QFileInfo( fileName ).fileName().toUtf8() );
+      while ( !file.atEnd() )
+      {
+        if ( *mCanceled != 0 )
+          return;
+        hash.addData( file.read( WATCHHASHBLOCKSIZE ) );
+      }
+    }
+
+    QMetaObject::invokeMethod( mReceiver, "fingerprintReady", Qt::QueuedConnection,
+                               Q_ARG( QString, mFileName ), Q_ARG( QString, QString( hash.result().toHex() ) ) );
+  }
+
+private:
+  QObject *mReceiver;
+  QString mFileName;
+  QAtomicInt *mCanceled;
+};
+
+QgsKmlFolderWatcher::QgsKmlFolderWatcher( QObject *parent )
+    : QObject( parent ), mWatcher( NULL ), mHashing( 0 ), mExporting( false ), mConverter( NULL ),
+    mLastExportTime( -1 ), mExports( 0 )
+{
+  mScanTimer.setSingleShot( true );
+  mScanTimer.setInterval( WATCHQUIETTIME );
+  connect( &mScanTimer, SIGNAL( timeout() ), SLOT( scan() ) );
+}
+
+QgsKmlFolderWatcher::~QgsKmlFolderWatcher()
+{
+  stop();
+}
+
+bool QgsKmlFolderWatcher::start()
+{
+  stop();
+
+  QSettings settings;
+  mInputDirs.clear();
+  foreach ( QString dirName, settings.value( "/qgis2google/watch/inputdirs" ).toString().split( ";", QString::SkipEmptyParts ) )
+  {
+    if ( QFileInfo( dirName.trimmed() ).isDir() )
+      mInputDirs << QDir( dirName.trimmed() ).absolutePath();
+  }
+  mOutputDir = settings.value( "/qgis2google/watch/outputdir" ).toString().trimmed();
+  if ( mInputDirs.isEmpty() || mOutputDir.isEmpty() || !QDir().mkpath( mOutputDir ) )
+    return false;
+
+  mPool.setMaxThreadCount( qMax( settings.value( "/qgis2google/watch/workers", 2 ).toInt(), 1 ) );
+  loadFingerprints();
+
+  mWatcher = new QFileSystemWatcher( mInputDirs, this );
+  connect( mWatcher, SIGNAL( directoryChanged( const QString & ) ), SLOT( pathChanged( const QString & ) ) );
+  connect( mWatcher, SIGNAL( fileChanged( const QString & ) ), SLOT( pathChanged( const QString & ) ) );
+
+  // datasets changed while nobody watched
+  scan();
+  return true;
+}
+
+void QgsKmlFolderWatcher::stop()
+{
+  mScanTimer.stop();
+  delete mWatcher;
+  mWatcher = NULL;
+
+  // export under way stops at its next yield and is not published
+  if ( mConverter )
+    mConverter->setCanceled( true );
+
+  // fingerprints under way stop at their next block, queued ones at the first,
+  // so waiting does not take the hash of whole datasets
+  mCanceled = 1;
+  mPool.waitForDone();
+  mCanceled = 0;
+  mHashing = 0;
+  mExportQueue.clear();
+  mPendingFingerprints.clear();
+  mSignatures.clear();
+}
+
+bool QgsKmlFolderWatcher::isRunning() const
+{
+  return mWatcher != NULL;
+}
+
+int QgsKmlFolderWatcher::queueDepth() const
+{
+  return mHashing + mExportQueue.count();
+}
+
+int QgsKmlFolderWatcher::lastExportTime() const
+{
+  return mLastExportTime;
+}
+
+QString QgsKmlFolderWatcher::status() const
+{
+  QString status = tr( "Watching %1 folders, %2 datasets queued" ).arg( mInputDirs.count() ).arg( queueDepth() );
+  if ( mLastExportTime >= 0 )
+    status += tr( ", %1 published, last %2 in %3 ms" ).arg( mExports ).arg( mLastExportName ).arg( mLastExportTime );
+  return status;
+}
+
+// writers change files in several steps, scan after the last one
+void QgsKmlFolderWatcher::pathChanged( const QString &path )
+{
+  Q_UNUSED( path );
+  mScanTimer.start();
+}
+
+void QgsKmlFolderWatcher::scan()
+{
+  if ( !mWatcher )
+    return;
+
+  foreach ( QString fileName, datasets() )
+  {
+    QStringList files = datasetFiles( fileName );
+    foreach ( QString file, files )
+    {
+      if ( !mWatcher->files().contains( file ) )
+        mWatcher->addPath( file );
+    }
+
+    // content is hashed only when the files look different
+    QString fileSignature = signature( files );
+    if ( mSignatures.value( fileName ) == fileSignature )
+      continue;
+    mSignatures.insert( fileName, fileSignature );
+
+    mHashing++;
+    mPool.start( new QgsKmlFingerprintTask( this, fileName, &mCanceled ) );
+  }
+  emit statusChanged( status() );
+}
+
+void QgsKmlFolderWatcher::fingerprintReady( const QString &fileName, const QString &fingerprint )
+{
+  if ( !mWatcher )
+    return;
+
+  mHashing = qMax( mHashing - 1, 0 );
+  if ( mFingerprints.value( fileName ) != fingerprint )
+  {
+    mPendingFingerprints.insert( fileName, fingerprint );
+    if ( !mExportQueue.contains( fileName ) )
+      mExportQueue << fileName;
+    if ( !mExporting )
+      QTimer::singleShot( 0, this, SLOT( exportNext() ) );
+  }
+  emit statusChanged( status() );
+}
+
+void QgsKmlFolderWatcher::exportNext()
+{
+  if ( mExporting || mExportQueue.isEmpty() )
+    return;
+
+  mExporting = true;
+  QString fileName = mExportQueue.takeFirst();
+  QString fingerprint = mPendingFingerprints.take( fileName );
+
+  // events processed by the export may stop or delete the watcher
+  QPointer<QgsKmlFolderWatcher> guard( this );
+  bool published = false;
+  QTime exportTime;
+  exportTime.start();
+  QgsVectorLayer *vlayer = new QgsVectorLayer( fileName, QFileInfo( fileName ).completeBaseName(), "ogr" );
+  if ( vlayer->isValid() )
+  {
+    // temporary kml of the converter is removed with it, styles are published in the kml
+    QgsKmlConverter converter;
+    converter.setInlineStyles( true );
+    converter.setYieldInterval( WATCHYIELDINTERVAL );
+    mConverter = &converter;
+    QString kmlFileName = converter.exportLayerToKmlFile( vlayer );
+    if ( !guard )
+    {
+      delete vlayer;
+      return;
+    }
+    mConverter = NULL;
+
+    if ( !converter.isCanceled() && !kmlFileName.isEmpty() && publish( kmlFileName, fileName ) )
+    {
+      mFingerprints.insert( fileName, fingerprint );
+      saveFingerprints();
+      mLastExportName = QFileInfo( fileName ).fileName();
+      mLastExportTime = exportTime.elapsed();
+      mExports++;
+      published = true;
+    }
+  }
+  else
+  {
+    QgsLogger::warning( tr( "Unable to open the dataset %1" ).arg( fileName ) );
+  }
+  delete vlayer;
+
+  // dataset is fingerprinted again by the next scan
+  if ( !published )
+    mSignatures.remove( fileName );
+
+  mExporting = false;
+  emit statusChanged( status() );
+  if ( !mExportQueue.isEmpty() )
+    QTimer::singleShot( 0, this, SLOT( exportNext() ) );
+}
+
+// vector datasets in the watched folders, shapefiles by their shp
+QStringList QgsKmlFolderWatcher::datasets() const
+{
+  QStringList filters;
+  filters << "*.shp" << "*.SHP" << "*.sqlite" << "*.gml" << "*.geojson" << "*.json" << "*.tab" << "*.mif" << "*.gpx";
+
+  QStringList fileNames;
+  foreach ( QString dirName, mInputDirs )
+  {
+    QDir dir( dirName );
+    foreach ( QString fileName, dir.entryList( filters, QDir::Files, QDir::Name ) )
+      fileNames << dir.absoluteFilePath( fileName );
+  }
+  return fileNames;
+}
+
+QString QgsKmlFolderWatcher::signature( const QStringList &files ) const
+{
+  QString result;
+  foreach ( QString fileName, files )
+  {
+    QFileInfo info( fileName );
+    result += info.fileName() + ":" + QString::number( info.size() ) + ":"
+              + QString::number( info.lastModified().toTime_t() ) + ";";
+  }
+  return result;
+}
+
+// copy next to the published file and rename it over, readers get the old file or the new one
+bool QgsKmlFolderWatcher::publish( const QString &kmlFileName, const QString &dataset )
+{
+  QFileInfo info( dataset );
+  QByteArray pathHash = QCryptographicHash::hash( info.absoluteFilePath().toUtf8(), QCryptographicHash::Md5 ).toHex().left( 8 );
+  QString target = QDir( mOutputDir ).absoluteFilePath( info.fileName() + "-" + pathHash + "."
+                                                         + QFileInfo( kmlFileName ).suffix() );
+  QString temp = target + ".part";
+  QFile::remove( temp );
+  if ( !QFile::copy( kmlFileName, temp ) )
+  {
+    QgsLogger::warning( tr( "Unable to write the file %1" ).arg( temp ) );
+    return false;
+  }
+
+  if ( ::rename( QFile::encodeName( temp ).constData(), QFile::encodeName( target ).constData() ) != 0 )
+  {
+    // rename does not replace files on Windows
+    QFile::remove( target );
+    if ( !QFile::rename( temp, target ) )
+    {
+      QgsLogger::warning( tr( "Unable to publish the file %1" ).arg( target ) );
+      QFile::remove( temp );
+      return false;
+    }
+  }
+  return true;
+}
+
+void QgsKmlFolderWatcher::loadFingerprints()
+{
+  mFingerprints.clear();
+  QSettings published( QDir( mOutputDir ).absoluteFilePath( ".qgis2google-watch.ini" ), QSettings::IniFormat );
+  foreach ( QString entry, published.value( "fingerprints" ).toStringList() )
+  {
+    QStringList parts = entry.split( "\t" );
+    if ( parts.count() == 2 )
+      mFingerprints.insert( parts.at( 0 ), parts.at( 1 ) );
+  }
+}
+
+void QgsKmlFolderWatcher::saveFingerprints()
+{
+  QStringList entries;
+  for ( QHash<QString, QString>::const_iterator it = mFingerprints.constBegin(); it != mFingerprints.constEnd(); ++it )
+    entries << it.key() + "\t" + it.value();
+
+  QSettings published( QDir( mOutputDir ).absoluteFilePath( ".qgis2google-watch.ini" ), QSettings::IniFormat );
+  published.setValue( "fingerprints", entries );
+}
@@ -0,0 +1,89 @@
+#ifndef QGSKMLFOLDERWATCHER_H
+#define QGSKMLFOLDERWATCHER_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QObject>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+
+class QFileSystemWatcher;
+class QgsKmlConverter;
+
+/**
+* \class QgsKmlFolderWatcher
+* \brief Publishes kml of datasets in watched folders whenever they change
+* Changes reported by the file system (inotify on Linux) start a scan once the
+* folders are quiet. Datasets whose size or time changed are fingerprinted by
+* their content on a bounded pool of threads, only those whose fingerprint differs
+* from the last published one are exported. Exports run one after another, as
+* providers are not thread safe, and let events in while the dataset is read, so
+* the watcher can be stopped meanwhile. Exports replace the published file by rename,
+* it is named by the dataset file and a hash of its path, so datasets of the same
+* name in other formats or folders do not collide.
+* Fingerprints of published datasets are kept in the output folder, so a restarted
+* watcher exports only what changed meanwhile.
+*/
+class QgsKmlFolderWatcher : public QObject
+{
+  Q_OBJECT
+public:
+  QgsKmlFolderWatcher( QObject *parent = 0 );
+  ~QgsKmlFolderWatcher();
+
+  //! watch input folders of the settings, false if there are none or no output folder
+  bool start();
+  void stop();
+  bool isRunning() const;
+
+  //! datasets being fingerprinted or waiting for export
+  int queueDepth() const;
+  //! duration of the last export (ms), -1 before the first one
+  int lastExportTime() const;
+  QString status() const;
+
+signals:
+  void statusChanged( const QString &status );
+
+private slots:
+  void pathChanged( const QString &path );
+  void scan();
+  void fingerprintReady( const QString &fileName, const QString &fingerprint );
+  void exportNext();
+
+private:
+  QStringList datasets() const;
+  //! size and modification time of the files of the dataset
+  QString signature( const QStringList &files ) const;
+  bool publish( const QString &kmlFileName, const QString &dataset );
+  void loadFingerprints();
+  void saveFingerprints();
+
+  QFileSystemWatcher *mWatcher;
+  //! scan waits for the folders to be quiet
+  QTimer mScanTimer;
+  QThreadPool mPool;
+  //! fingerprints under way stop at their next block
+  QAtomicInt mCanceled;
+
+  QStringList mInputDirs;
+  QString mOutputDir;
+
+  QHash<QString, QString> mSignatures;
+  //! fingerprints of published datasets and of the datasets waiting for export
+  QHash<QString, QString> mFingerprints;
+  QHash<QString, QString> mPendingFingerprints;
+
+  int mHashing;
+  QStringList mExportQueue;
+  bool mExporting;
+  //! converter of the running export, canceled by stop()
+  QgsKmlConverter *mConverter;
+
+  QString mLastExportName;
+  int mLastExportTime;
+  int mExports;
+};
+
+#endif // QGSKMLFOLDERWATCHER_H
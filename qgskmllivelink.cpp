@@ -0,0 +1,131 @@
+#include <QSettings>
+#include <QTimer>
+
+#include <qgsvectorlayer.h>
+
+#include "qgskmlconverter.h"
+#include "qgskmllivelink.h"
+
+// how often the update is written (ms) and reloaded by Google Earth (s), an
+// update stays at least one reload interval
+#define LIVEWRITEINTERVAL 2000
+#define LIVEREFRESHINTERVAL 2
+
+QgsKmlLiveLink::QgsKmlLiveLink( QgsVectorLayer *vlayer, QObject *parent )
+    : QObject( parent ), mLayer( vlayer ), mConverter( new QgsKmlConverter ),
+    mTimer( new QTimer( this ) ), mDirty( false )
+{
+  connect( mLayer, SIGNAL( featureAdded( int ) ), SLOT( featureAdded( int ) ) );
+  connect( mLayer, SIGNAL( featureDeleted( int ) ), SLOT( featureDeleted( int ) ) );
+  connect( mLayer, SIGNAL( geometryChanged( int, QgsGeometry & ) ), SLOT( geometryChanged( int, QgsGeometry & ) ) );
+  connect( mLayer, SIGNAL( attributeValueChanged( int, int, const QVariant & ) ),
+           SLOT( attributeValueChanged( int, int, const QVariant & ) ) );
+  connect( mLayer, SIGNAL( editingStopped() ), SLOT( editingStopped() ) );
+  connect( mLayer, SIGNAL( destroyed() ), SLOT( layerDestroyed() ) );
+
+  mTimer->setInterval( LIVEWRITEINTERVAL );
+  connect( mTimer, SIGNAL( timeout() ), SLOT( writeUpdate() ) );
+}
+
+QgsKmlLiveLink::~QgsKmlLiveLink()
+{
+  delete mConverter;
+}
+
+bool QgsKmlLiveLink::isSupported()
+{
+  QSettings settings;
+  return !settings.value( "/qgis2google/merge/enabled" ).toBool()
+         && !settings.value( "/qgis2google/cluster/enabled" ).toBool();
+}
+
+QString QgsKmlLiveLink::start()
+{
+  if ( !mLayer || !isSupported() )
+    return QString();
+
+  mLayerFileName = mConverter->exportLayerToKmlFile( mLayer );
+  if ( mLayerFileName.isEmpty() )
+    return QString();
+
+  mUpdateFileName = mConverter->exportLayerUpdate( mLayer, mLayerFileName, QgsFeatureIds(), QgsFeatureIds() );
+  if ( mUpdateFileName.isEmpty() )
+    return QString();
+
+  mLinkFileName = mConverter->exportUpdateLink( mUpdateFileName );
+  if ( mLinkFileName.isEmpty() )
+    return QString();
+
+  mTimer->start();
+  return mConverter->exportLiveLink( mLayer->name(), mLayerFileName, mLinkFileName, LIVEREFRESHINTERVAL );
+}
+
+void QgsKmlLiveLink::featureAdded( int fid )
+{
+  featureChanged( fid );
+}
+
+void QgsKmlLiveLink::featureDeleted( int fid )
+{
+  mChangedIds.remove( fid );
+  mDeletedIds.insert( fid );
+  mDirty = true;
+}
+
+void QgsKmlLiveLink::geometryChanged( int fid, QgsGeometry &geom )
+{
+  Q_UNUSED( geom );
+  featureChanged( fid );
+}
+
+void QgsKmlLiveLink::attributeValueChanged( int fid, int idx, const QVariant &value )
+{
+  Q_UNUSED( idx );
+  Q_UNUSED( value );
+  featureChanged( fid );
+}
+
+void QgsKmlLiveLink::featureChanged( int fid )
+{
+  mChangedIds.insert( fid );
+  mDirty = true;
+}
+
+// features added while editing get other ids when committed, so the link
+// follows one editing session only
+void QgsKmlLiveLink::editingStopped()
+{
+  writeUpdate();
+  mTimer->stop();
+}
+
+void QgsKmlLiveLink::layerDestroyed()
+{
+  mTimer->stop();
+  mLayer = NULL;
+}
+
+void QgsKmlLiveLink::writeUpdate()
+{
+  if ( !mDirty || !mLayer )
+    return;
+
+  // features edited again since the last update are written in their current state
+  QgsFeatureIds changedIds = ( mPreviousChangedIds - mDeletedIds ) + mChangedIds;
+  QgsFeatureIds deletedIds = ( mPreviousDeletedIds - mChangedIds ) + mDeletedIds;
+  QString updateFileName = mConverter->exportLayerUpdate( mLayer, mLayerFileName, changedIds, deletedIds );
+  if ( updateFileName.isEmpty() || mConverter->exportUpdateLink( updateFileName, mLinkFileName ).isEmpty() )
+    return;
+
+  // update before the last one is not linked any more
+  if ( !mPreviousUpdateFileName.isEmpty() )
+    mConverter->removeTempFile( mPreviousUpdateFileName );
+  mPreviousUpdateFileName = mUpdateFileName;
+  mUpdateFileName = updateFileName;
+
+  mPreviousChangedIds = mChangedIds;
+  mPreviousDeletedIds = mDeletedIds;
+  mChangedIds.clear();
+  mDeletedIds.clear();
+  mDirty = !mPreviousChangedIds.isEmpty() || !mPreviousDeletedIds.isEmpty();
+}
@@ -0,0 +1,69 @@
+#ifndef QGSKMLLIVELINK_H
+#define QGSKMLLIVELINK_H
+
+#include <QObject>
+#include <QVariant>
+
+#include <qgsfeature.h>
+
+class QTimer;
+
+class QgsGeometry;
+class QgsKmlConverter;
+class QgsVectorLayer;
+
+/**
+* \class QgsKmlLiveLink
+* \brief Lets Google Earth follow edits of a layer
+* The layer is exported once, then features edited since the last update are
+* written as kml Update to a new file, which a link reloaded periodically by
+* Google Earth points to. Each edit goes to two updates in a row, so it is not
+* lost when Google Earth skips one reload. Merged and clustered placemarks have
+* no ids to update, the link refuses such settings.
+*/
+class QgsKmlLiveLink : public QObject
+{
+  Q_OBJECT
+public:
+  QgsKmlLiveLink( QgsVectorLayer *vlayer, QObject *parent = 0 );
+  ~QgsKmlLiveLink();
+
+  //! export the layer, return kml to be opened in Google Earth or empty string
+  QString start();
+  //! placemarks are written one per feature with ids, neither merged nor clustered
+  static bool isSupported();
+
+private slots:
+  void featureAdded( int fid );
+  void featureDeleted( int fid );
+  void geometryChanged( int fid, QgsGeometry &geom );
+  void attributeValueChanged( int fid, int idx, const QVariant &value );
+  void editingStopped();
+  void layerDestroyed();
+  void writeUpdate();
+
+private:
+  void featureChanged( int fid );
+
+  QgsVectorLayer *mLayer;
+  //! owns exported files, they are removed with it
+  QgsKmlConverter *mConverter;
+  QTimer *mTimer;
+
+  QString mLayerFileName;
+  //! reloaded by Google Earth, points to the latest update
+  QString mLinkFileName;
+  QString mUpdateFileName;
+  QString mPreviousUpdateFileName;
+
+  //! features edited since the last update, changed ones include added
+  QgsFeatureIds mChangedIds;
+  QgsFeatureIds mDeletedIds;
+  //! features written to the last update, they go to the next one as well
+  QgsFeatureIds mPreviousChangedIds;
+  QgsFeatureIds mPreviousDeletedIds;
+  //! next update has something to write
+  bool mDirty;
+};
+
+#endif // QGSKMLLIVELINK_H
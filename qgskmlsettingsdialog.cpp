@@ -6,8 +6,9 @@
 #include "qgskmlsettingsdialog.h"
 #include "ui_qgskmlsettingsdialogbase.h"
 
-QgsKmlSettingsDialog::QgsKmlSettingsDialog(QWidget *parent, QGis::GeometryType typeOfFeature ) :
-    QDialog(parent), m_ui(new Ui::QgsKmlSettingsDialog)
+QgsKmlSettingsDialog::QgsKmlSettingsDialog(QWidget *parent, QGis::GeometryType typeOfFeature,
+                                           const QStringList &fieldNames, const QString &layerId ) :
+    QDialog(parent), m_ui(new Ui::QgsKmlSettingsDialog), mLayerId( layerId )
 {
   m_ui->setupUi(this);
 
@@ -18,6 +19,7 @@ QgsKmlSettingsDialog::QgsKmlSettingsDialog(QWidget *parent, QGis::GeometryType t
   QgsApplication::setApplicationName( "qgis2google2" );
 
   setTypeOfTab( typeOfFeature );
+  initFieldList( fieldNames );
   readSettings();
 }
 
@@ -55,6 +57,17 @@ void QgsKmlSettingsDialog::setTypeOfTab( QGis::GeometryType typeOfFeature )
   }
 }
 
+// fields of the current layer which can be exported as ExtendedData
+void QgsKmlSettingsDialog::initFieldList( const QStringList &fieldNames )
+{
+  foreach ( QString fieldName, fieldNames )
+  {
+    QListWidgetItem *item = new QListWidgetItem( fieldName, m_ui->lwExtendedDataFields );
+    item->setFlags( item->flags() | Qt::ItemIsUserCheckable );
+    item->setCheckState( Qt::Unchecked );
+  }
+}
+
 void QgsKmlSettingsDialog::setAltitudeItemsData( QComboBox *comboBox )
 {
   comboBox->setItemData( 0, "clampToGround" );
@@ -243,6 +256,73 @@ void QgsKmlSettingsDialog::readSettings()
   m_ui->tabWidget->setEnabled( false );
   tmpInt = settings.value( "/qgis2google/overridelayerstyle", 0 ).toBool();
   m_ui->chbOverrideLayerStyle->setChecked( tmpInt );
+
+  tmpInt = settings.value( "/qgis2google/extendeddata/enabled", 0 ).toBool();
+  m_ui->chbExtendedData->setChecked( tmpInt );
+  QStringList extendedDataFields = settings.value( "/qgis2google/extendeddata/fields" ).toStringList();
+  for ( int i = 0; i < m_ui->lwExtendedDataFields->count(); i++ )
+  {
+    QListWidgetItem *item = m_ui->lwExtendedDataFields->item( i );
+    item->setCheckState( extendedDataFields.contains( item->text() ) ? Qt::Checked : Qt::Unchecked );
+  }
+
+  tmpInt = settings.value( "/qgis2google/cluster/enabled", 0 ).toBool();
+  m_ui->chbCluster->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/cluster/levels", 4 ).toInt();
+  m_ui->sbxClusterLevels->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/merge/enabled", 0 ).toBool();
+  m_ui->chbMerge->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/merge/batchsize", 1000 ).toInt();
+  m_ui->sbxMergeBatchSize->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/preview/features", 1000 ).toInt();
+  m_ui->sbxPreviewFeatures->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/simplify/enabled", 0 ).toBool();
+  m_ui->chbSimplify->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/simplify/maxvertices", 10000 ).toInt();
+  m_ui->sbxSimplifyMaxVertices->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/style/external", 0 ).toBool();
+  m_ui->chbExternalStyles->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/icon/embed", 0 ).toBool();
+  m_ui->chbEmbedIcons->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/compact/enabled", 0 ).toBool();
+  m_ui->chbCompact->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/quantize/enabled", 0 ).toBool();
+  m_ui->chbQuantize->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/quantize/decimals", 0 ).toInt();
+  m_ui->sbxQuantizeDecimals->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/checkpoint/enabled", 0 ).toBool();
+  m_ui->chbCheckpoint->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/preencode/enabled", 0 ).toBool();
+  m_ui->chbPreEncode->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/database/enabled", 0 ).toBool();
+  m_ui->chbDatabaseKml->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/shapefile/mapped", 0 ).toBool();
+  m_ui->chbMappedShapefiles->setChecked( tmpInt );
+  tmpInt = settings.value( "/qgis2google/watch/workers", 2 ).toInt();
+  m_ui->sbxWatchWorkers->setValue( tmpInt );
+  tmpInt = settings.value( "/qgis2google/superoverlay/levels", 4 ).toInt();
+  m_ui->sbxTileLevels->setValue( tmpInt );
+
+  // filters are kept per layer, fields of one layer mean nothing to another
+  tmpStr = mLayerId.isEmpty() ? QString() : settings.value( "/qgis2google/filter/layers/" + mLayerId ).toString();
+  m_ui->leFilter->setText( tmpStr );
+  m_ui->leFilter->setEnabled( !mLayerId.isEmpty() );
+  tmpInt = settings.value( "/qgis2google/filter/canvasextent", 0 ).toBool();
+  m_ui->chbCanvasExtent->setChecked( tmpInt );
+  // templates refer to fields of the layer as well
+  QString templateKey = "/qgis2google/template/layers/" + mLayerId;
+  tmpStr = mLayerId.isEmpty() ? QString() : settings.value( templateKey + "/name" ).toString();
+  m_ui->leNameTemplate->setText( tmpStr );
+  m_ui->leNameTemplate->setEnabled( !mLayerId.isEmpty() );
+  tmpStr = mLayerId.isEmpty() ? QString() : settings.value( templateKey + "/description" ).toString();
+  m_ui->leDescriptionTemplate->setText( tmpStr );
+  m_ui->leDescriptionTemplate->setEnabled( !mLayerId.isEmpty() );
+  tmpStr = settings.value( "/qgis2google/partition/field" ).toString();
+  m_ui->lePartitionField->setText( tmpStr );
+  tmpStr = settings.value( "/qgis2google/watch/inputdirs" ).toString();
+  m_ui->leWatchInputDirs->setText( tmpStr );
+  tmpStr = settings.value( "/qgis2google/watch/outputdir" ).toString();
+  m_ui->leWatchOutputDir->setText( tmpStr );
 }
 
 void QgsKmlSettingsDialog::writeSettings()
@@ -289,6 +369,60 @@ void QgsKmlSettingsDialog::writeSettings()
   settings.setValue( "/qgis2google/poly/outline", qstringToBool( m_ui->cbPolyOutline->currentText() ) );
 
   settings.setValue( "/qgis2google/overridelayerstyle", m_ui->chbOverrideLayerStyle->isChecked() );
+
+  QStringList extendedDataFields;
+  for ( int i = 0; i < m_ui->lwExtendedDataFields->count(); i++ )
+  {
+    QListWidgetItem *item = m_ui->lwExtendedDataFields->item( i );
+    if ( item->checkState() == Qt::Checked )
+      extendedDataFields << item->text();
+  }
+  settings.setValue( "/qgis2google/extendeddata/enabled", m_ui->chbExtendedData->isChecked() );
+  settings.setValue( "/qgis2google/extendeddata/fields", extendedDataFields );
+
+  settings.setValue( "/qgis2google/cluster/enabled", m_ui->chbCluster->isChecked() );
+  settings.setValue( "/qgis2google/cluster/levels", m_ui->sbxClusterLevels->value() );
+  settings.setValue( "/qgis2google/merge/enabled", m_ui->chbMerge->isChecked() );
+  settings.setValue( "/qgis2google/merge/batchsize", m_ui->sbxMergeBatchSize->value() );
+  settings.setValue( "/qgis2google/preview/features", m_ui->sbxPreviewFeatures->value() );
+  settings.setValue( "/qgis2google/simplify/enabled", m_ui->chbSimplify->isChecked() );
+  settings.setValue( "/qgis2google/simplify/maxvertices", m_ui->sbxSimplifyMaxVertices->value() );
+  settings.setValue( "/qgis2google/style/external", m_ui->chbExternalStyles->isChecked() );
+  settings.setValue( "/qgis2google/icon/embed", m_ui->chbEmbedIcons->isChecked() );
+  settings.setValue( "/qgis2google/compact/enabled", m_ui->chbCompact->isChecked() );
+  settings.setValue( "/qgis2google/quantize/enabled", m_ui->chbQuantize->isChecked() );
+  settings.setValue( "/qgis2google/quantize/decimals", m_ui->sbxQuantizeDecimals->value() );
+  settings.setValue( "/qgis2google/checkpoint/enabled", m_ui->chbCheckpoint->isChecked() );
+  settings.setValue( "/qgis2google/preencode/enabled", m_ui->chbPreEncode->isChecked() );
+  settings.setValue( "/qgis2google/database/enabled", m_ui->chbDatabaseKml->isChecked() );
+  settings.setValue( "/qgis2google/shapefile/mapped", m_ui->chbMappedShapefiles->isChecked() );
+  settings.setValue( "/qgis2google/watch/workers", m_ui->sbxWatchWorkers->value() );
+  settings.setValue( "/qgis2google/superoverlay/levels", m_ui->sbxTileLevels->value() );
+
+  if ( !mLayerId.isEmpty() )
+  {
+    if ( m_ui->leFilter->text().trimmed().isEmpty() )
+      settings.remove( "/qgis2google/filter/layers/" + mLayerId );
+    else
+      settings.setValue( "/qgis2google/filter/layers/" + mLayerId, m_ui->leFilter->text() );
+
+    QString templateKey = "/qgis2google/template/layers/" + mLayerId;
+    if ( m_ui->leNameTemplate->text().trimmed().isEmpty() )
+      settings.remove( templateKey + "/name" );
+    else
+      settings.setValue( templateKey + "/name", m_ui->leNameTemplate->text() );
+    if ( m_ui->leDescriptionTemplate->text().trimmed().isEmpty() )
+      settings.remove( templateKey + "/description" );
+    else
+      settings.setValue( templateKey + "/description", m_ui->leDescriptionTemplate->text() );
+  }
+  settings.remove( "/qgis2google/filter/expression" );
+  settings.setValue( "/qgis2google/filter/canvasextent", m_ui->chbCanvasExtent->isChecked() );
+  settings.remove( "/qgis2google/template/name" );
+  settings.remove( "/qgis2google/template/description" );
+  settings.setValue( "/qgis2google/partition/field", m_ui->lePartitionField->text().trimmed() );
+  settings.setValue( "/qgis2google/watch/inputdirs", m_ui->leWatchInputDirs->text() );
+  settings.setValue( "/qgis2google/watch/outputdir", m_ui->leWatchOutputDir->text() );
 }
 
 void QgsKmlSettingsDialog::on_buttonBox_accepted()
@@ -564,3 +698,28 @@ void QgsKmlSettingsDialog::on_chbOverrideLayerStyle_toggled( bool checked )
 {
   m_ui->tabWidget->setEnabled( checked );
 }
+
+void QgsKmlSettingsDialog::on_chbExtendedData_toggled( bool checked )
+{
+  m_ui->lwExtendedDataFields->setEnabled( checked );
+}
+
+void QgsKmlSettingsDialog::on_chbCluster_toggled( bool checked )
+{
+  m_ui->sbxClusterLevels->setEnabled( checked );
+}
+
+void QgsKmlSettingsDialog::on_chbMerge_toggled( bool checked )
+{
+  m_ui->sbxMergeBatchSize->setEnabled( checked );
+}
+
+void QgsKmlSettingsDialog::on_chbSimplify_toggled( bool checked )
+{
+  m_ui->sbxSimplifyMaxVertices->setEnabled( checked );
+}
+
+void QgsKmlSettingsDialog::on_chbQuantize_toggled( bool checked )
+{
+  m_ui->sbxQuantizeDecimals->setEnabled( checked );
+}
@@ -17,7 +17,9 @@ namespace Ui {
 class QgsKmlSettingsDialog : public QDialog {
   Q_OBJECT
 public:
-  QgsKmlSettingsDialog(QWidget *parent = 0, QGis::GeometryType typeOfFeature = QGis::Point );
+  //! filter is set for the layer of layerId, none without a layer
+  QgsKmlSettingsDialog(QWidget *parent = 0, QGis::GeometryType typeOfFeature = QGis::Point,
+                       const QStringList &fieldNames = QStringList(), const QString &layerId = QString() );
   ~QgsKmlSettingsDialog();
 
 protected:
@@ -49,10 +51,16 @@ private slots:
   void on_sbxPolyOpacity_valueChanged( int value );
 
   void on_chbOverrideLayerStyle_toggled( bool checked );
+  void on_chbExtendedData_toggled( bool checked );
+  void on_chbCluster_toggled( bool checked );
+  void on_chbMerge_toggled( bool checked );
+  void on_chbSimplify_toggled( bool checked );
+  void on_chbQuantize_toggled( bool checked );
 
 private:
   void initComboBoxes();
   void setTypeOfTab( QGis::GeometryType typeOfFeature );
+  void initFieldList( const QStringList &fieldNames );
 
   void readSettings();
   void writeSettings();
@@ -75,6 +83,7 @@ private:
   void setAltitudeModeToolTip( QComboBox *comboBox );
 
   Ui::QgsKmlSettingsDialog *m_ui;
+  QString mLayerId;
 };
 
 #endif // QGSKMLSETTINGSDIALOG_H
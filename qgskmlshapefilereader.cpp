@@ -0,0 +1,362 @@
+#include <QFileInfo>
+#include <QFuture>
+#include <QRegExp>
+#include <QSysInfo>
+#include <QTextCodec>
+#include <QThread>
+#include <QtConcurrentRun>
+#include <QtEndian>
+
+#include <qgis.h>
+#include <qgsgeometry.h>
+
+#include "qgskmlshapefilereader.h"
+
+// fewest records decoded by one thread
+#define SHAPEFILEMINRANGE 1000
+
+// shape types, Z and M variants begin the same way
+#define SHPNULL 0
+#define SHPPOINT 1
+#define SHPPOLYLINE 3
+#define SHPPOLYGON 5
+#define SHPMULTIPOINT 8
+
+static double leDouble( const uchar *data )
+{
+  quint64 bits = qFromLittleEndian<quint64>( data );
+  double value;
+  memcpy( &value, &bits, sizeof( value ) );
+  return value;
+}
+
+// wkb in byte order of this machine, as QgsGeometry reads it
+static void appendWkbHeader( QByteArray &wkb, int type )
+{
+  char byteOrder = QSysInfo::ByteOrder == QSysInfo::LittleEndian ? 1 : 0;
+  wkb.append( byteOrder );
+  wkb.append( reinterpret_cast<const char *>( &type ), sizeof( type ) );
+}
+
+static void appendWkbInt( QByteArray &wkb, int value )
+{
+  wkb.append( reinterpret_cast<const char *>( &value ), sizeof( value ) );
+}
+
+static void appendWkbPoints( QByteArray &wkb, const uchar *points, int first, int last )
+{
+  for ( int i = first; i < last; i++ )
+  {
+    double xy[2] = { leDouble( points + 16 * i ), leDouble( points + 16 * i + 8 ) };
+    wkb.append( reinterpret_cast<const char *>( xy ), sizeof( xy ) );
+  }
+}
+
+QgsKmlShapefileReader::QgsKmlShapefileReader( const QString &shpFileName )
+    : mShp( NULL ), mShx( NULL ), mDbf( NULL ), mRecords( 0 ), mDbfHeaderLength( 0 ), mDbfRecordLength( 0 ),
+    mFailedRecords( 0 ), mCanceled( 0 )
+{
+  // other files are named the same, in the case of the extension
+  QFileInfo info( shpFileName );
+  QString base = info.absolutePath() + "/" + info.completeBaseName();
+  bool upper = info.suffix() == "SHP";
+  mShpFile.setFileName( shpFileName );
+  mShxFile.setFileName( base + ( upper ? ".SHX" : ".shx" ) );
+  mDbfFile.setFileName( base + ( upper ? ".DBF" : ".dbf" ) );
+}
+
+QgsKmlShapefileReader::~QgsKmlShapefileReader()
+{
+  if ( mShp )
+    mShpFile.unmap( const_cast<uchar *>( mShp ) );
+  if ( mShx )
+    mShxFile.unmap( const_cast<uchar *>( mShx ) );
+  if ( mDbf )
+    mDbfFile.unmap( const_cast<uchar *>( mDbf ) );
+}
+
+bool QgsKmlShapefileReader::open()
+{
+  mShp = mapFile( mShpFile );
+  mShx = mapFile( mShxFile );
+  mDbf = mapFile( mDbfFile );
+  if ( !mShp || !mShx || !mDbf || mShxFile.size() < 100 || mDbfFile.size() < 32 )
+    return false;
+
+  mDbfHeaderLength = qFromLittleEndian<quint16>( mDbf + 8 );
+  mDbfRecordLength = qFromLittleEndian<quint16>( mDbf + 10 );
+  int dbfRecords = qFromLittleEndian<quint32>( mDbf + 4 );
+  if ( mDbfHeaderLength < 33 || mDbfRecordLength < 1
+       || mDbfHeaderLength + qint64( dbfRecords ) * mDbfRecordLength > mDbfFile.size() )
+    return false;
+
+  // column descriptors end with 0x0d, values follow the deletion flag of the record
+  mColumns.clear();
+  int offset = 1;
+  for ( int pos = 32; pos + 32 <= mDbfHeaderLength && mDbf[pos] != 0x0d; pos += 32 )
+  {
+    DbfColumn column = { offset, mDbf[pos + 16], char( mDbf[pos + 11] ) };
+    mColumns << column;
+    offset += column.length;
+  }
+  if ( offset > mDbfRecordLength )
+    return false;
+
+  mRecords = qMin( dbfRecords, int( ( mShxFile.size() - 100 ) / 8 ) );
+  return true;
+}
+
+int QgsKmlShapefileReader::featureCount() const
+{
+  return mRecords;
+}
+
+QgsFeatureList QgsKmlShapefileReader::features( const QgsAttributeList &attributes, const QgsFieldMap &fields,
+                                                QTextCodec *codec ) const
+{
+  int threads = qMax( QThread::idealThreadCount(), 1 );
+  int rangeSize = qMax( SHAPEFILEMINRANGE, ( mRecords + threads - 1 ) / threads );
+  QList< QFuture<QgsFeatureList> > ranges = readRanges( attributes, fields, codec, rangeSize );
+
+  QgsFeatureList features;
+  foreach ( QFuture<QgsFeatureList> range, ranges )
+    features += range.result();
+  return features;
+}
+
+QList< QFuture<QgsFeatureList> > QgsKmlShapefileReader::readRanges( const QgsAttributeList &attributes,
+                                                                    const QgsFieldMap &fields, QTextCodec *codec,
+                                                                    int rangeSize ) const
+{
+  mFailedRecords = 0;
+  mCanceled = 0;
+  rangeSize = qMax( rangeSize, 1 );
+
+  QList< QFuture<QgsFeatureList> > ranges;
+  for ( int first = 0; first < mRecords; first += rangeSize )
+    ranges << QtConcurrent::run( this, &QgsKmlShapefileReader::readRange, first,
+                                 qMin( first + rangeSize, mRecords ), attributes, fields, codec );
+  return ranges;
+}
+
+void QgsKmlShapefileReader::cancel() const
+{
+  mCanceled = 1;
+}
+
+bool QgsKmlShapefileReader::hasError() const
+{
+  return mFailedRecords != 0;
+}
+
+// deleted records are left out as by OGR. A record which can not be decoded makes
+// the features incomplete, so the ranges stop
+QgsFeatureList QgsKmlShapefileReader::readRange( int first, int last, const QgsAttributeList &attributes,
+                                                 const QgsFieldMap &fields, QTextCodec *codec ) const
+{
+  QgsFeatureList features;
+  for ( int i = first; i < last; i++ )
+  {
+    const uchar *record = mDbf + mDbfHeaderLength + qint64( i ) * mDbfRecordLength;
+    if ( record[0] == '*' )
+      continue;
+
+    if ( mFailedRecords != 0 || mCanceled != 0 )
+      break;
+
+    QgsFeature feature( i );
+    if ( !readGeometry( i, feature ) )
+    {
+      mFailedRecords.ref();
+      break;
+    }
+
+    bool decoded = true;
+    foreach ( int index, attributes )
+    {
+      if ( index < 0 || index >= mColumns.count() )
+        continue;
+      QVariant value = readAttribute( record, mColumns.at( index ), fields.value( index ).type(), codec );
+      decoded = decoded && value.isValid();
+      feature.addAttribute( index, value );
+    }
+    if ( !decoded )
+    {
+      mFailedRecords.ref();
+      break;
+    }
+    features << feature;
+  }
+  return features;
+}
+
+// geometry of the record as OGR makes it: single part lines and polygons stay single,
+// holes are counterclockwise rings following their outer ring, z and m are dropped
+bool QgsKmlShapefileReader::readGeometry( int record, QgsFeature &feature ) const
+{
+  const uchar *index = mShx + 100 + 8 * record;
+  qint64 offset = qint64( qFromBigEndian<qint32>( index ) ) * 2;
+  qint64 length = qint64( qFromBigEndian<qint32>( index + 4 ) ) * 2;
+  if ( offset < 100 || length < 4 || offset + 8 + length > mShpFile.size() )
+    return false;
+
+  const uchar *shape = mShp + offset + 8;
+  int type = qFromLittleEndian<qint32>( shape );
+  if ( type == SHPNULL )
+    return true;
+  if ( type > 30 )
+    return false;
+
+  QByteArray wkb;
+  switch ( type % 10 )
+  {
+  case SHPPOINT:
+    if ( length < 20 )
+      return false;
+    appendWkbHeader( wkb, QGis::WKBPoint );
+    appendWkbPoints( wkb, shape + 4, 0, 1 );
+    break;
+
+  case SHPMULTIPOINT:
+    {
+      if ( length < 40 )
+        return false;
+      int count = qFromLittleEndian<qint32>( shape + 36 );
+      if ( count < 0 || 40 + 16 * qint64( count ) > length )
+        return false;
+
+      appendWkbHeader( wkb, QGis::WKBMultiPoint );
+      appendWkbInt( wkb, count );
+      for ( int i = 0; i < count; i++ )
+      {
+        appendWkbHeader( wkb, QGis::WKBPoint );
+        appendWkbPoints( wkb, shape + 40, i, i + 1 );
+      }
+      break;
+    }
+
+  case SHPPOLYLINE:
+  case SHPPOLYGON:
+    {
+      if ( length < 44 )
+        return false;
+      int partCount = qFromLittleEndian<qint32>( shape + 36 );
+      int pointCount = qFromLittleEndian<qint32>( shape + 40 );
+      if ( partCount < 1 || pointCount < 0 || 44 + 4 * qint64( partCount ) + 16 * qint64( pointCount ) > length )
+        return false;
+
+      const uchar *points = shape + 44 + 4 * partCount;
+      QList<int> starts;
+      for ( int i = 0; i < partCount; i++ )
+      {
+        int start = qFromLittleEndian<qint32>( shape + 44 + 4 * i );
+        if ( start < 0 || start > pointCount || ( i > 0 && start < starts.last() ) )
+          return false;
+        starts << start;
+      }
+      starts << pointCount;
+
+      if ( type % 10 == SHPPOLYLINE )
+      {
+        if ( partCount > 1 )
+        {
+          appendWkbHeader( wkb, QGis::WKBMultiLineString );
+          appendWkbInt( wkb, partCount );
+        }
+        for ( int i = 0; i < partCount; i++ )
+        {
+          appendWkbHeader( wkb, QGis::WKBLineString );
+          appendWkbInt( wkb, starts.at( i + 1 ) - starts.at( i ) );
+          appendWkbPoints( wkb, points, starts.at( i ), starts.at( i + 1 ) );
+        }
+        break;
+      }
+
+      // outer rings are clockwise, that is of negative area
+      QList< QList<int> > polygons;
+      for ( int i = 0; i < partCount; i++ )
+      {
+        double area = 0.0;
+        for ( int j = starts.at( i ); j + 1 < starts.at( i + 1 ); j++ )
+          area += leDouble( points + 16 * j ) * leDouble( points + 16 * ( j + 1 ) + 8 )
+                  - leDouble( points + 16 * ( j + 1 ) ) * leDouble( points + 16 * j + 8 );
+        if ( area < 0.0 || polygons.isEmpty() )
+          polygons << QList<int>();
+        polygons.last() << i;
+      }
+
+      if ( polygons.count() > 1 )
+      {
+        appendWkbHeader( wkb, QGis::WKBMultiPolygon );
+        appendWkbInt( wkb, polygons.count() );
+      }
+      foreach ( const QList<int> &rings, polygons )
+      {
+        appendWkbHeader( wkb, QGis::WKBPolygon );
+        appendWkbInt( wkb, rings.count() );
+        foreach ( int ring, rings )
+        {
+          appendWkbInt( wkb, starts.at( ring + 1 ) - starts.at( ring ) );
+          appendWkbPoints( wkb, points, starts.at( ring ), starts.at( ring + 1 ) );
+        }
+      }
+      break;
+    }
+
+  default:
+    return false;
+  }
+
+  // geometry takes the buffer
+  unsigned char *geometry = new unsigned char[wkb.size()];
+  memcpy( geometry, wkb.constData(), wkb.size() );
+  feature.setGeometryAndOwnership( geometry, wkb.size() );
+  return true;
+}
+
+// values are converted as the OGR provider does, blank numbers and dates are null,
+// dates are text as OGR writes them. Invalid for values the reader does not decode
+QVariant QgsKmlShapefileReader::readAttribute( const uchar *record, const DbfColumn &column, QVariant::Type type,
+                                               QTextCodec *codec ) const
+{
+  QByteArray bytes( reinterpret_cast<const char *>( record + column.offset ), column.length );
+  if ( column.type == 'D' )
+  {
+    QString text = QString::fromLatin1( bytes.constData(), bytes.size() ).trimmed();
+    if ( text.isEmpty() )
+      return QVariant( QVariant::String );
+    // OGR reads other forms of dates too, they are left to it
+    if ( text.length() != 8 || !QRegExp( "\\d{8}" ).exactMatch( text ) )
+      return QVariant();
+    return QVariant( text.left( 4 ) + "/" + text.mid( 4, 2 ) + "/" + text.mid( 6, 2 ) );
+  }
+
+  switch ( type )
+  {
+  case QVariant::Int:
+  case QVariant::Double:
+    {
+      QString text = QString::fromLatin1( bytes.constData(), bytes.size() ).trimmed();
+      if ( text.isEmpty() || text.startsWith( '*' ) )
+        return QVariant( type );
+      return type == QVariant::Int ? QVariant( text.toInt() ) : QVariant( text.toDouble() );
+    }
+
+  default:
+    {
+      int size = bytes.size();
+      while ( size > 0 && ( bytes.at( size - 1 ) == ' ' || bytes.at( size - 1 ) == '\0' ) )
+        size--;
+      if ( size == 0 )
+        return QVariant( QVariant::String );
+      return QVariant( codec ? codec->toUnicode( bytes.left( size ) ) : QString::fromLatin1( bytes.left( size ) ) );
+    }
+  }
+}
+
+const uchar *QgsKmlShapefileReader::mapFile( QFile &file )
+{
+  if ( !file.open( QIODevice::ReadOnly ) || file.size() == 0 )
+    return NULL;
+  return file.map( 0, file.size() );
+}
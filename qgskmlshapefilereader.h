@@ -0,0 +1,79 @@
+#ifndef QGSKMLSHAPEFILEREADER_H
+#define QGSKMLSHAPEFILEREADER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+#include <QFuture>
+#include <QList>
+#include <QString>
+#include <QVariant>
+
+#include <qgsfeature.h>
+#include <qgsfield.h>
+
+class QTextCodec;
+
+/**
+* \class QgsKmlShapefileReader
+* \brief Features of a shapefile read from its mapped .shp, .shx and .dbf files
+* Records are decoded in parallel ranges found by the .shx offsets to the same
+* features the OGR provider gives: geometries as OGR assembles them, only the
+* requested dbf columns, converted to the types of the fields. The reader does
+* not need a layer, so it can serve conversions outside QGIS as well.
+*/
+class QgsKmlShapefileReader
+{
+public:
+  QgsKmlShapefileReader( const QString &shpFileName );
+  ~QgsKmlShapefileReader();
+
+  //! map the files and read the headers, false for files which are missing or not understood
+  bool open();
+  int featureCount() const;
+  //! features with ids of the records, attributes are indexes of dbf columns,
+  //! fields give their types and codec the encoding of text
+  QgsFeatureList features( const QgsAttributeList &attributes, const QgsFieldMap &fields, QTextCodec *codec ) const;
+  //! start decoding the features in ranges of rangeSize records, results of the ranges
+  //! follow the records. Callers collect them between events
+  QList< QFuture<QgsFeatureList> > readRanges( const QgsAttributeList &attributes, const QgsFieldMap &fields,
+                                               QTextCodec *codec, int rangeSize ) const;
+  //! ranges under way stop at their next record
+  void cancel() const;
+  //! the last features() met a record it could not decode, as of MultiPatch or a broken one,
+  //! and its features are not complete
+  bool hasError() const;
+
+private:
+  struct DbfColumn
+  {
+    int offset;
+    int length;
+    char type;
+  };
+
+  QgsFeatureList readRange( int first, int last, const QgsAttributeList &attributes,
+                            const QgsFieldMap &fields, QTextCodec *codec ) const;
+  bool readGeometry( int record, QgsFeature &feature ) const;
+  QVariant readAttribute( const uchar *record, const DbfColumn &column, QVariant::Type type,
+                          QTextCodec *codec ) const;
+
+  const uchar *mapFile( QFile &file );
+
+  QFile mShpFile;
+  QFile mShxFile;
+  QFile mDbfFile;
+  const uchar *mShp;
+  const uchar *mShx;
+  const uchar *mDbf;
+
+  int mRecords;
+  int mDbfHeaderLength;
+  int mDbfRecordLength;
+  QList<DbfColumn> mColumns;
+  //! records which could not be decoded, counted by all ranges
+  mutable QAtomicInt mFailedRecords;
+  mutable QAtomicInt mCanceled;
+};
+
+#endif // QGSKMLSHAPEFILEREADER_H
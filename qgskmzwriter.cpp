@@ -0,0 +1,172 @@
+#include <QBuffer>
+#include <QDataStream>
+#include <QDateTime>
+
+#include <zlib.h>
+
+#include "qgskmzwriter.h"
+
+// zip record signatures and compression methods
+#define ZIPLOCALHEADER 0x04034b50
+#define ZIPCENTRALHEADER 0x02014b50
+#define ZIPENDOFDIRECTORY 0x06054b50
+#define ZIPVERSION 20
+#define ZIPSTORED 0
+#define ZIPDEFLATED 8
+// sizes and offsets above need zip64, 0xffffffff itself marks zip64 fields
+#define ZIPMAXSIZE Q_INT64_C( 0xfffffffe )
+#define ZIPCHUNKSIZE 262144
+
+QgsKmzWriter::QgsKmzWriter( const QString &fileName )
+    : mFile( fileName )
+{
+  QDateTime now = QDateTime::currentDateTime();
+  mDosTime = ( now.time().hour() << 11 ) | ( now.time().minute() << 5 ) | ( now.time().second() / 2 );
+  mDosDate = ( ( now.date().year() - 1980 ) << 9 ) | ( now.date().month() << 5 ) | now.date().day();
+}
+
+QgsKmzWriter::~QgsKmzWriter()
+{
+  if ( mFile.isOpen() )
+    close();
+}
+
+bool QgsKmzWriter::open()
+{
+  mEntries.clear();
+  return mFile.open( QIODevice::WriteOnly | QIODevice::Truncate );
+}
+
+bool QgsKmzWriter::addFile( const QString &name, const QByteArray &data, bool compress )
+{
+  QBuffer buffer;
+  buffer.setData( data );
+  buffer.open( QIODevice::ReadOnly );
+  return addFile( name, &buffer, compress );
+}
+
+bool QgsKmzWriter::addFile( const QString &name, QIODevice *device, bool compress )
+{
+  qint64 offset = mFile.pos();
+  if ( offset > ZIPMAXSIZE )
+    return false;
+
+  Entry entry;
+  entry.name = name.toUtf8();
+  entry.method = compress ? ZIPDEFLATED : ZIPSTORED;
+  entry.crc = 0;
+  entry.compressedSize = 0;
+  entry.size = 0;
+  entry.offset = offset;
+
+  // crc and sizes are known after the data, the header is written again then
+  if ( !writeLocalHeader( entry ) )
+    return false;
+
+  // zip wants raw deflate data without zlib header and checksum
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  if ( compress && deflateInit2( &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+    return false;
+
+  QByteArray deflated( ZIPCHUNKSIZE, 0 );
+  uLong crc = ::crc32( 0L, Z_NULL, 0 );
+  qint64 size = 0;
+  qint64 compressedSize = 0;
+  bool ok = true;
+  bool last = false;
+  while ( ok && !last )
+  {
+    QByteArray chunk = device->read( ZIPCHUNKSIZE );
+    last = chunk.isEmpty() || device->atEnd();
+    crc = ::crc32( crc, reinterpret_cast<const Bytef *>( chunk.constData() ), chunk.size() );
+    size += chunk.size();
+
+    if ( compress )
+    {
+      stream.next_in = reinterpret_cast<Bytef *>( chunk.data() );
+      stream.avail_in = chunk.size();
+      do
+      {
+        stream.next_out = reinterpret_cast<Bytef *>( deflated.data() );
+        stream.avail_out = deflated.size();
+        deflate( &stream, last ? Z_FINISH : Z_NO_FLUSH );
+        int have = deflated.size() - stream.avail_out;
+        ok = mFile.write( deflated.constData(), have ) == have && ok;
+        compressedSize += have;
+      }
+      while ( stream.avail_out == 0 );
+    }
+    else
+    {
+      ok = mFile.write( chunk ) == chunk.size();
+      compressedSize += chunk.size();
+    }
+
+    // archive stops as soon as it would need zip64
+    ok = ok && size <= ZIPMAXSIZE && compressedSize <= ZIPMAXSIZE;
+  }
+  if ( compress )
+    deflateEnd( &stream );
+  if ( !ok )
+    return false;
+
+  entry.crc = crc;
+  entry.size = size;
+  entry.compressedSize = compressedSize;
+  qint64 end = mFile.pos();
+  if ( !mFile.seek( offset ) || !writeLocalHeader( entry ) || !mFile.seek( end ) )
+    return false;
+
+  mEntries << entry;
+  return true;
+}
+
+bool QgsKmzWriter::writeLocalHeader( const Entry &entry )
+{
+  QDataStream out( &mFile );
+  out.setByteOrder( QDataStream::LittleEndian );
+  out << quint32( ZIPLOCALHEADER ) << quint16( ZIPVERSION ) << quint16( 0 ) << entry.method
+      << mDosTime << mDosDate << entry.crc << entry.compressedSize << entry.size
+      << quint16( entry.name.size() ) << quint16( 0 );
+  out.writeRawData( entry.name.constData(), entry.name.size() );
+  return out.status() == QDataStream::Ok;
+}
+
+bool QgsKmzWriter::close()
+{
+  QDataStream out( &mFile );
+  out.setByteOrder( QDataStream::LittleEndian );
+
+  if ( mFile.pos() > ZIPMAXSIZE || mEntries.count() > 0xffff )
+  {
+    mFile.close();
+    return false;
+  }
+
+  quint32 directoryOffset = mFile.pos();
+  foreach ( const Entry &entry, mEntries )
+  {
+    out << quint32( ZIPCENTRALHEADER ) << quint16( ZIPVERSION ) << quint16( ZIPVERSION ) << quint16( 0 )
+        << entry.method << mDosTime << mDosDate << entry.crc << entry.compressedSize << entry.size
+        << quint16( entry.name.size() ) << quint16( 0 ) << quint16( 0 ) << quint16( 0 ) << quint16( 0 )
+        << quint32( 0 ) << entry.offset;
+    out.writeRawData( entry.name.constData(), entry.name.size() );
+  }
+  if ( mFile.pos() > ZIPMAXSIZE )
+  {
+    mFile.close();
+    return false;
+  }
+  quint32 directorySize = mFile.pos() - directoryOffset;
+
+  out << quint32( ZIPENDOFDIRECTORY ) << quint16( 0 ) << quint16( 0 )
+      << quint16( mEntries.count() ) << quint16( mEntries.count() )
+      << directorySize << directoryOffset << quint16( 0 );
+
+  bool ok = out.status() == QDataStream::Ok;
+  mFile.close();
+  return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef QGSKMZWRITER_H
+#define QGSKMZWRITER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QList>
+#include <QString>
+
+/**
+* \class QgsKmzWriter
+* \brief Writes kmz, a zip archive holding kml document and files it refers to
+* Entries are either deflated or stored as they are (for already compressed
+* images). Data is streamed in chunks, archives which would need zip64 fail.
+*/
+class QgsKmzWriter
+{
+public:
+  QgsKmzWriter( const QString &fileName );
+  ~QgsKmzWriter();
+
+  bool open();
+  //! add file to the archive under name (relative path with '/' separators)
+  bool addFile( const QString &name, const QByteArray &data, bool compress = true );
+  //! add data read from the open device to its end
+  bool addFile( const QString &name, QIODevice *device, bool compress = true );
+  //! write zip directory and close the file
+  bool close();
+
+private:
+  struct Entry
+  {
+    QByteArray name;
+    quint16 method;
+    quint32 crc;
+    quint32 compressedSize;
+    quint32 size;
+    quint32 offset;
+  };
+
+  bool writeLocalHeader( const Entry &entry );
+
+  QFile mFile;
+  QList<Entry> mEntries;
+  quint16 mDosTime;
+  quint16 mDosDate;
+};
+
+#endif // QGSKMZWRITER_H